@@ -1,5 +1,7 @@
 #ifdef _WIN32
 #   define _CRT_SECURE_NO_WARNINGS
+#elif defined(__linux__)
+#   define _GNU_SOURCE     // copy_file_range
 #endif
 
 #include <stdio.h>
@@ -13,11 +15,40 @@
 
 #ifdef _WIN32
 #   define DIR_SEPARATOR '\\'
+#   define DSK_THREAD_LOCAL __declspec(thread)
+#   include <windows.h>
 #else
 #   define DIR_SEPARATOR '/'
+#   define DSK_HAVE_MMAP
+#   define DSK_HAVE_PREAD
+#   define DSK_HAVE_FTRUNCATE
+#   include <sys/mman.h>
+#   include <sys/uio.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <pthread.h>
+#   define DSK_THREAD_LOCAL __thread
+#endif
+
+// macOS has no posix_fallocate, ftruncate alone is used there
+#if defined(__linux__) || defined(__FreeBSD__)
+#   define DSK_HAVE_FALLOCATE
+#endif
+
+// vectorized line ending translation, AVX2 is selected at runtime
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define DSK_HAVE_SSE2
+#   include <emmintrin.h>
+#endif
+
+#if defined(DSK_HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define DSK_HAVE_AVX2
+#   include <immintrin.h>
 #endif
 
 static void dsk_default_output(const char *s);
+static int check_locked(DSK_Drive *drv, int repair);
 DSK_Print dsk_puts = dsk_default_output;
 
 //----------------------------------------
@@ -48,18 +79,234 @@ static void dsk_default_output(const char *s)
 }
 
 //----------------------------------------
-// DSK formatted output function
+// DSK formatted output function, drv may be NULL
 //----------------------------------------
-static void dsk_printf(char *format, ...)
+static void dsk_printf(DSK_Drive *drv, const char *format, ...)
 {
 	char buf[DSK_PRINTF_BUF_SIZE];
 	va_list valist;
 
 	va_start(valist, format);
-	vsprintf(buf, format, valist);
+	vsnprintf(buf, sizeof(buf), format, valist);
 	va_end(valist);
 
-	dsk_puts(buf);
+	if (drv && drv->output)
+		drv->output(buf);
+	else
+		dsk_puts(buf);
+}
+
+//----------------------------------------
+// per drive locks
+//
+// Library calls take the drive's reader/writer lock, shared for calls
+// that only read the DSK and exclusive for calls that change it. The
+// state lock guards what shared holders still change: the track cache,
+// the chain index and the file offset when there is no pread.
+//
+// Calls nest (e.g. dsk_del flushes), so each thread keeps a stack of
+// the drives it holds and only the outermost call locks.
+//----------------------------------------
+#define DSK_MAX_HELD_DRIVES 8
+
+struct DSK_Lock
+{
+#ifdef _WIN32
+    SRWLOCK rw;
+    CRITICAL_SECTION state;
+#else
+    pthread_rwlock_t rw;
+    pthread_mutex_t state;
+#endif
+};
+
+static DSK_THREAD_LOCAL DSK_Drive *held_drives[DSK_MAX_HELD_DRIVES];
+static DSK_THREAD_LOCAL int held_exclusive[DSK_MAX_HELD_DRIVES];
+static DSK_THREAD_LOCAL int held_count;
+
+//----------------------------------------
+// create a lock, NULL if out of memory
+//----------------------------------------
+static struct DSK_Lock *lock_new(void)
+{
+    struct DSK_Lock *lock = malloc(sizeof(struct DSK_Lock));
+    if (!lock)
+        return NULL;
+
+#ifdef _WIN32
+    InitializeSRWLock(&lock->rw);
+    InitializeCriticalSection(&lock->state);
+#else
+    if (pthread_rwlock_init(&lock->rw, NULL))
+    {
+        free(lock);
+        return NULL;
+    }
+
+    pthread_mutex_init(&lock->state, NULL);
+#endif
+
+    return lock;
+}
+
+//----------------------------------------
+// destroy a lock made by lock_new
+//----------------------------------------
+static void lock_free(struct DSK_Lock *lock)
+{
+    if (!lock)
+        return;
+
+#ifdef _WIN32
+    DeleteCriticalSection(&lock->state);
+#else
+    pthread_rwlock_destroy(&lock->rw);
+    pthread_mutex_destroy(&lock->state);
+#endif
+
+    free(lock);
+}
+
+//----------------------------------------
+// take and release the mutex part of a lock
+//----------------------------------------
+static void mutex_lock(struct DSK_Lock *lock)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&lock->state);
+#else
+    pthread_mutex_lock(&lock->state);
+#endif
+}
+
+//
+static void mutex_unlock(struct DSK_Lock *lock)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&lock->state);
+#else
+    pthread_mutex_unlock(&lock->state);
+#endif
+}
+
+//----------------------------------------
+// create the locks for a newly mounted drive
+//----------------------------------------
+static int drive_lock_init(DSK_Drive *drv)
+{
+    drv->lock = lock_new();
+
+    return drv->lock ? E_OK : E_FAIL;
+}
+
+//----------------------------------------
+// destroy the locks of a drive being unmounted
+//----------------------------------------
+static void drive_lock_free(DSK_Drive *drv)
+{
+    lock_free(drv->lock);
+    drv->lock = NULL;
+}
+
+//----------------------------------------
+// return index of drv on this thread's held stack, -1 if not held
+//----------------------------------------
+static int held_index(DSK_Drive *drv)
+{
+    for (int i = held_count - 1; i >= 0; i--)
+    {
+        if (held_drives[i] == drv)
+            return i;
+    }
+
+    return -1;
+}
+
+//----------------------------------------
+// take the drive lock, shared or exclusive
+// drives that are not mounted have no lock, callers report the error
+//----------------------------------------
+static void drive_lock(DSK_Drive *drv, int exclusive)
+{
+    if (!drv || !drv->lock)
+        return;
+
+    int held = held_index(drv);
+
+    // running on unlocked, or only shared, would corrupt the drive
+    if (held_count >= DSK_MAX_HELD_DRIVES)
+    {
+        dsk_printf(drv, "drive locks nested too deeply.\n");
+        abort();
+    }
+
+    // a shared holder cannot upgrade without deadlocking
+    if (held >= 0 && exclusive && !held_exclusive[held])
+    {
+        dsk_printf(drv, "cannot change a drive while reading it.\n");
+        abort();
+    }
+
+    if (held < 0)
+    {
+#ifdef _WIN32
+        if (exclusive)
+            AcquireSRWLockExclusive(&drv->lock->rw);
+        else
+            AcquireSRWLockShared(&drv->lock->rw);
+#else
+        if (exclusive)
+            pthread_rwlock_wrlock(&drv->lock->rw);
+        else
+            pthread_rwlock_rdlock(&drv->lock->rw);
+#endif
+    }
+    else
+        exclusive = held_exclusive[held];
+
+    held_drives[held_count] = drv;
+    held_exclusive[held_count] = exclusive;
+    held_count++;
+}
+
+//----------------------------------------
+// release the drive lock taken by the matching drive_lock
+//----------------------------------------
+static void drive_unlock(DSK_Drive *drv)
+{
+    if (!held_count || held_drives[held_count - 1] != drv)
+        return;
+
+    int exclusive = held_exclusive[--held_count];
+
+    if (held_index(drv) >= 0)
+        return;
+
+#ifdef _WIN32
+    if (exclusive)
+        ReleaseSRWLockExclusive(&drv->lock->rw);
+    else
+        ReleaseSRWLockShared(&drv->lock->rw);
+#else
+    (void)exclusive;
+    pthread_rwlock_unlock(&drv->lock->rw);
+#endif
+}
+
+//----------------------------------------
+// guard state that shared lock holders change
+//----------------------------------------
+static void state_lock(DSK_Drive *drv)
+{
+    if (drv->lock)
+        mutex_lock(drv->lock);
+}
+
+//
+static void state_unlock(DSK_Drive *drv)
+{
+    if (drv->lock)
+        mutex_unlock(drv->lock);
 }
 
 //----------------------------------------
@@ -69,7 +316,7 @@ static long dsk_get_file_size(DSK_Drive* drv)
 {
     if (!drv || !drv->fp)
     {
-        dsk_printf("disk invalid\n");
+        dsk_printf(drv, "disk invalid\n");
         return 0;
     }
 
@@ -88,7 +335,7 @@ static int dsk_is_simple_file(DSK_Drive* drv)
 {
     if (!drv || !drv->fp)
     {
-        dsk_printf("disk invalid\n");
+        dsk_printf(drv, "disk invalid\n");
         return FALSE;
     }
 
@@ -103,31 +350,81 @@ static int dsk_is_simple_file(DSK_Drive* drv)
 }
 
 //----------------------------------------
-// count granules used by file
+// return the granule chain of a file, building it if the FAT has
+// changed since it was last used
 //----------------------------------------
-static int count_granules(DSK_Drive *drv, int gran, int *tail_sectors)
+static DSK_Chain *build_chain(DSK_Drive *drv, DSK_DirEntry *dirent)
 {
-    int count = 0;
+    int entry = dirent - drv->dirs;
+    DSK_Chain *chain = drv->chains[entry];
 
-    assert(drv && drv->fp);
+    assert(entry >= 0 && entry < DSK_MAX_DIR_ENTRIES);
 
-    if (!drv || !drv->fp)
+    if (chain && chain->generation == drv->fat_generation && chain->first_granule == dirent->first_granule)
+        return chain;
+
+    if (!chain)
     {
-        dsk_printf("disk invalid\n");
-        return E_FAIL;
+        chain = malloc(sizeof(DSK_Chain));
+        if (!chain)
+        {
+            dsk_printf(drv, "out of memory.\n");
+            return NULL;
+        }
+
+        drv->chains[entry] = chain;
     }
 
+    chain->generation = drv->fat_generation - 1;
+    chain->first_granule = dirent->first_granule;
+    chain->count = 0;
+
+    int gran = dirent->first_granule;
+
+    // a chain no longer than the disk or the granules array, whichever is shorter
+    int limit = DSK_TOTAL_GRANULES < DSK_MAX_GRANULES ? DSK_TOTAL_GRANULES : DSK_MAX_GRANULES;
+
     while (!DSK_IS_LAST_GRANULE(gran))
     {
-        count++;
+        if (gran >= DSK_TOTAL_GRANULES || chain->count >= limit)
+        {
+            dsk_printf(drv, "granule chain invalid.\n");
+            return NULL;
+        }
+
+        chain->granules[chain->count++] = gran;
         gran = drv->fat.granule_map[gran];
     }
 
-    // return number of sectors in last granule
-    if (tail_sectors)
-        *tail_sectors = gran & DSK_SECTOR_COUNT_MASK;
-    
-    return count;
+    // number of sectors in last granule
+    chain->tail_sectors = gran & DSK_SECTOR_COUNT_MASK;
+    chain->generation = drv->fat_generation;
+
+    return chain;
+}
+
+//----------------------------------------
+// get_chain under the state lock, readers may build chains together
+//----------------------------------------
+static DSK_Chain *get_chain(DSK_Drive *drv, DSK_DirEntry *dirent)
+{
+    state_lock(drv);
+    DSK_Chain *chain = build_chain(drv, dirent);
+    state_unlock(drv);
+
+    return chain;
+}
+
+//----------------------------------------
+// drop all cached granule chains
+//----------------------------------------
+static void free_chains(DSK_Drive *drv)
+{
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        free(drv->chains[i]);
+        drv->chains[i] = NULL;
+    }
 }
 
 //---------------------------------------------
@@ -135,62 +432,70 @@ static int count_granules(DSK_Drive *drv, int gran, int *tail_sectors)
 //---------------------------------------------
 static int granule_chain(DSK_Drive *drv, DSK_DirEntry *dirent)
 {
-    assert(drv && drv->fp);
+    assert(drv && drv->drv_status == DSK_MOUNTED);
 
-    if (!drv || !drv->fp)
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("disk invalid\n");
+        dsk_printf(drv, "disk invalid\n");
         return E_FAIL;
     }
 
-    int gran = dirent->first_granule;
+    DSK_Chain *chain = get_chain(drv, dirent);
+    if (!chain)
+        return E_FAIL;
 
-    while (!DSK_IS_LAST_GRANULE(gran))
-    {
-        dsk_printf("%02X->", gran);
-        gran = drv->fat.granule_map[gran];
-    }
+    for (int i = 0; i < chain->count; i++)
+        dsk_printf(drv, "%02X->", chain->granules[i]);
     
-    dsk_printf("%02X\n", gran);
+    dsk_printf(drv, "%02X\n", drv->fat.granule_map[chain->granules[chain->count - 1]]);
 
     return E_OK;
 }
 
+//------------------------------------
+// return the size of a file from its chain and directory entry, or
+// E_FAIL if a damaged entry gives a size outside its granules
+//------------------------------------
+static long chain_file_size(DSK_Chain *chain, DSK_DirEntry *dirent)
+{
+    int tail_sectors = chain->tail_sectors;
+    int bytes_in_last_sector = ntohs(dirent->bytes_in_last_sector);
+
+    DSK_TRACE("tail sectors: %d, bytes in last sector: %d\n", tail_sectors, bytes_in_last_sector);
+
+    if (!chain->count || tail_sectors > DSK_SECTORS_PER_GRANULE || bytes_in_last_sector > DSK_BYTES_DATA_PER_SECTOR)
+        return E_FAIL;
+
+    // full sectors plus partial sector
+    if (bytes_in_last_sector && tail_sectors)
+        tail_sectors--;
+
+    return (long)(chain->count - 1) * DSK_BYTES_PER_GRANULE + tail_sectors * DSK_BYTES_DATA_PER_SECTOR + bytes_in_last_sector;
+}
+
 //----------------------------------------
 // return size of file
 //----------------------------------------
 static int file_size(DSK_Drive *drv, DSK_DirEntry *dirent)
 {
-    assert(drv && drv->fp);
+    assert(drv && drv->drv_status == DSK_MOUNTED);
 
-    if (!drv || !drv->fp)
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("disk invalid.\n");
+        dsk_printf(drv, "disk invalid.\n");
         return E_FAIL;
     }
 
     // get granule count and count of sectors in last granule
-    int sectors = 0;
-    int grans = count_granules(drv, dirent->first_granule, &sectors);
-
-    // add in size of full granules
-    int size = (grans - 1) * DSK_BYTES_PER_GRANULE;
-
-    // add in size of full sectors
-    if (sectors)
-    {
-        if (dirent->bytes_in_last_sector)
-            size += (sectors - 1) * DSK_BYTES_DATA_PER_SECTOR;
-        else
-            size += (sectors) * DSK_BYTES_DATA_PER_SECTOR;
-    }
-
-    // add in bytes in last sector
-    size += ntohs(dirent->bytes_in_last_sector);
+    DSK_Chain *chain = get_chain(drv, dirent);
+    if (!chain)
+        return E_FAIL;
 
-    DSK_TRACE("%d total grans, %d sectors in last gran, %d bytes in last sector\n", grans, sectors, ntohs(dirent->bytes_in_last_sector));
+    long size = chain_file_size(chain, dirent);
+    if (size < 0)
+        dsk_printf(drv, "file size invalid.\n");
 
-    return size;
+    return (int)size;
 }
 
 //------------------------------------
@@ -212,126 +517,373 @@ static char *file_ncopy(char *dst, char *src, int n)
 }
 
 //----------------------------------------------
-// look for the given file in the DSK directory
+// return TRUE if dir entry is in use
 //----------------------------------------------
-static DSK_DirEntry *find_file_in_dir(DSK_Drive *drv, const char *filename)
+static int dir_entry_in_use(const DSK_DirEntry *dirent)
 {
-    char dirfile[DSK_MAX_FILENAME + DSK_MAX_EXT + 2];
+    return dirent->filename[0] != DSK_DIRENT_DELETED && DSK_DIRENT_FREE != (uint8_t)dirent->filename[0];
+}
 
-    // find dir entry
-    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+//----------------------------------------------
+// build the "NAME.EXT" form of a dir entry name
+//----------------------------------------------
+static char *dir_entry_name(DSK_DirEntry *dirent, char *dirfile)
+{
+    file_ncopy(dirfile, dirent->filename, DSK_MAX_FILENAME);
+    if (dirent->ext[0] != ' ')
     {
-        DSK_DirEntry *dirent = &drv->dirs[i];
+        strcat(dirfile, ".");
+        strncat(dirfile, dirent->ext, DSK_MAX_EXT);
+    }
 
-        if (dirent->filename[0] == DSK_DIRENT_DELETED || DSK_DIRENT_FREE == (uint8_t)dirent->filename[0])
-            continue;
+    for (int j = 0; j < strlen(dirfile); j++)
+        if (dirfile[j] == ' ')
+            dirfile[j] = 0;
 
-        file_ncopy(dirfile, dirent->filename, DSK_MAX_FILENAME);
-        if (dirent->ext[0] != ' ')
-        {
-            strcat(dirfile, ".");
-            strncat(dirfile, dirent->ext, DSK_MAX_EXT);
-        }
+    return dirfile;
+}
 
-        for (int j = 0; j < strlen(dirfile); j++)
-            if (dirfile[j] == ' ')
-                dirfile[j] = 0;
+//----------------------------------------------
+// case insensitive match of name against a pattern with * and ?
+//----------------------------------------------
+static int match_pattern(const char *pattern, const char *name)
+{
+    const char *star = NULL, *resume = NULL;
 
-        if (!strcasecmp(filename, dirfile))
-            return dirent;
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            resume = name;
+        }
+        else if (*pattern == '?' || toupper((uint8_t)*pattern) == toupper((uint8_t)*name))
+        {
+            pattern++;
+            name++;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            name = ++resume;
+        }
+        else
+        {
+            return FALSE;
+        }
     }
 
-    return NULL;
+    while (*pattern == '*')
+        pattern++;
+
+    return !*pattern;
 }
 
-//----------------------------------------
-// override the default output function
-//----------------------------------------
-void dsk_set_output_function(DSK_Print f)
+//----------------------------------------------
+// hash an upper case "NAME.EXT"
+//----------------------------------------------
+static unsigned dir_hash(const char *name)
 {
-    dsk_puts = f;
+    unsigned h = 2166136261u;
+
+    for (; *name; name++)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+
+    return h & (DSK_DIR_HASH_SIZE - 1);
 }
 
-//----------------------------------------
-// count free granules on drive
-//----------------------------------------
-int dsk_free_granules(DSK_Drive *drv)
+//----------------------------------------------
+// add dir entry to the name index
+//----------------------------------------------
+static void dir_index_add(DSK_Drive *drv, DSK_DirEntry *dirent)
 {
-    int count = 0;
+    int entry = dirent - drv->dirs;
+    char *name = drv->dir_names[entry];
 
-    assert(drv && drv->fp);
+    dir_entry_name(dirent, name);
+    for (char *p = name; *p; p++)
+        *p = toupper((uint8_t)*p);
 
-    if (!drv || !drv->fp)
+    unsigned slot = dir_hash(name);
+    while (drv->dir_index[slot] >= 0)
+        slot = (slot + 1) & (DSK_DIR_HASH_SIZE - 1);
+
+    drv->dir_index[slot] = entry;
+}
+
+//----------------------------------------------
+// remove dir entry from the name index
+//----------------------------------------------
+static void dir_index_remove(DSK_Drive *drv, DSK_DirEntry *dirent)
+{
+    const unsigned mask = DSK_DIR_HASH_SIZE - 1;
+    int entry = dirent - drv->dirs;
+
+    unsigned slot = dir_hash(drv->dir_names[entry]);
+    while (drv->dir_index[slot] != entry)
     {
-        dsk_printf("disk invalid\n");
-        return E_FAIL;
+        if (drv->dir_index[slot] < 0)
+            return;
+        slot = (slot + 1) & mask;
     }
 
-    for (int i = 0; i < DSK_TOTAL_GRANULES; i++)
+    drv->dir_index[slot] = -1;
+    drv->dir_names[entry][0] = 0;
+
+    // shift back later entries of the probe run that can now move up
+    for (unsigned next = (slot + 1) & mask; drv->dir_index[next] >= 0; next = (next + 1) & mask)
     {
-        if (drv->fat.granule_map[i] == DSK_GRANULE_FREE)
-            count++;
-    }
+        unsigned home = dir_hash(drv->dir_names[drv->dir_index[next]]);
 
-    return count;
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            drv->dir_index[slot] = drv->dir_index[next];
+            drv->dir_index[next] = -1;
+            slot = next;
+        }
+    }
 }
 
-//----------------------------------------
-// calc free bytes on DSK
-//----------------------------------------
-int dsk_free_bytes(DSK_Drive *drv)
+//----------------------------------------------
+// rebuild the name index from the directory
+//----------------------------------------------
+static void build_dir_index(DSK_Drive *drv)
 {
-    assert(drv && drv->fp);
+    memset(drv->dir_index, -1, sizeof(drv->dir_index));
 
-    if (!drv || !drv->fp)
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
     {
-        dsk_printf("disk invalid\n");
-        return E_FAIL;
-    }
+        drv->dir_names[i][0] = 0;
 
-    int grans = dsk_free_granules(drv);
-    int count = grans * DSK_BYTES_PER_GRANULE;
-    return count;
+        if (dir_entry_in_use(&drv->dirs[i]))
+            dir_index_add(drv, &drv->dirs[i]);
+    }
 }
 
-//----------------------------------------
+//----------------------------------------------
+// look for the given file in the DSK directory
+//----------------------------------------------
+static DSK_DirEntry *find_file_in_dir(DSK_Drive *drv, const char *filename)
+{
+    char name[DSK_MAX_FILENAME + DSK_MAX_EXT + 2];
+
+    if (strlen(filename) >= sizeof(name))
+        return NULL;
+
+    for (int i = 0; (name[i] = toupper((uint8_t)filename[i])); i++)
+        ;
+
+    for (unsigned slot = dir_hash(name); drv->dir_index[slot] >= 0; slot = (slot + 1) & (DSK_DIR_HASH_SIZE - 1))
+    {
+        int entry = drv->dir_index[slot];
+
+        if (!strcmp(name, drv->dir_names[entry]))
+            return &drv->dirs[entry];
+    }
+
+    return NULL;
+}
+
+//----------------------------------------
+// override the default output function
+//----------------------------------------
+void dsk_set_output_function(DSK_Print f)
+{
+    dsk_puts = f;
+}
+
+//----------------------------------------
+// send messages about drv to f rather than the global output function
+// NULL restores the global output function
+//----------------------------------------
+static int set_drive_output_locked(DSK_Drive *drv, DSK_Print f)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    drv->output = f;
+
+    return E_OK;
+}
+
+//----------------------------------------
+// return TRUE if granule is free
+//----------------------------------------
+static int granule_is_free(DSK_Drive *drv, int gran)
+{
+    return (drv->free_map[gran / 32] >> (gran % 32)) & 1;
+}
+
+//----------------------------------------
+// return TRUE if a FAT value leaves the granule free for allocation
+// inside a transaction granules freed since dsk_begin stay reserved,
+// so a rollback never finds their data overwritten
+//----------------------------------------
+static int granule_available(DSK_Drive *drv, int gran, uint8_t value)
+{
+    if (value != DSK_GRANULE_FREE)
+        return FALSE;
+
+    // the FAT on the DSK is the one from dsk_begin
+    return !drv->in_transaction || drv->meta_shadow[0][gran] == DSK_GRANULE_FREE;
+}
+
+//----------------------------------------
+// rebuild the free granule map and count after the FAT is replaced
+//----------------------------------------
+static void build_free_map(DSK_Drive *drv)
+{
+    memset(drv->free_map, 0, sizeof(drv->free_map));
+    drv->free_granules = 0;
+    drv->fat_generation++;
+
+    for (int i = 0; i < DSK_TOTAL_GRANULES; i++)
+    {
+        if (granule_available(drv, i, drv->fat.granule_map[i]))
+        {
+            drv->free_map[i / 32] |= 1u << (i % 32);
+            drv->free_granules++;
+        }
+    }
+}
+
+//----------------------------------------
+// set a FAT entry, keeping the free map and count current
+//----------------------------------------
+static void set_granule(DSK_Drive *drv, int gran, uint8_t value)
+{
+    int was_free = granule_is_free(drv, gran);
+    int is_free = granule_available(drv, gran, value);
+
+    drv->fat.granule_map[gran] = value;
+    drv->fat_generation++;
+
+    if (was_free == is_free)
+        return;
+
+    if (is_free)
+    {
+        drv->free_map[gran / 32] |= 1u << (gran % 32);
+        drv->free_granules++;
+    }
+    else
+    {
+        drv->free_map[gran / 32] &= ~(1u << (gran % 32));
+        drv->free_granules--;
+    }
+}
+
+//----------------------------------------
+// index of lowest set bit
+//----------------------------------------
+static int lowest_bit(uint32_t bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(bits);
+#else
+    int n = 0;
+
+    for (; !(bits & 1); bits >>= 1)
+        n++;
+
+    return n;
+#endif
+}
+
+//----------------------------------------
+// return first free granule at or after start, or -1
+//----------------------------------------
+static int next_free_granule(DSK_Drive *drv, int start)
+{
+    for (int w = start / 32; w < DSK_FREE_MAP_WORDS && w * 32 < DSK_TOTAL_GRANULES; w++)
+    {
+        uint32_t bits = drv->free_map[w];
+
+        if (w == start / 32)
+            bits &= ~0u << (start % 32);
+
+        if (bits)
+            return w * 32 + lowest_bit(bits);
+    }
+
+    return -1;
+}
+
+//----------------------------------------
+// count free granules on drive
+//----------------------------------------
+static int free_granules_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid\n");
+        return E_FAIL;
+    }
+
+    return drv->free_granules;
+}
+
+//----------------------------------------
+// calc free bytes on DSK
+//----------------------------------------
+static int free_bytes_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid\n");
+        return E_FAIL;
+    }
+
+    return drv->free_granules * DSK_BYTES_PER_GRANULE;
+}
+
+//----------------------------------------
 // print a directory of the mounted drive
 //----------------------------------------
-int dsk_dir(DSK_Drive *drv)
+static int dir_locked(DSK_Drive *drv)
 {
     char file[DSK_MAX_FILENAME + 1], ext[DSK_MAX_EXT + 1];
 
-    if (!drv || !drv->fp)
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("no disk mounted.\n");
+        dsk_printf(drv, "no disk mounted.\n");
         return E_FAIL;
     }
 
     memset(file, 0, sizeof(file));
     memset(ext, 0, sizeof(ext));
 
-    dsk_printf("Directory of '%s'\n\n", drv->filename);
+    dsk_printf(drv, "Directory of '%s'\n\n", drv->filename);
 
     for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
     {
         DSK_DirEntry *dirent = &drv->dirs[i];
 
-        if (dirent->filename[0] != DSK_DIRENT_DELETED && DSK_DIRENT_FREE != (uint8_t)dirent->filename[0])
+        if (dir_entry_in_use(dirent))
         {
             strncpy(file, dirent->filename, DSK_MAX_FILENAME);
             strncpy(ext, dirent->ext, DSK_MAX_EXT);
 
-            int grans = count_granules(drv, dirent->first_granule, NULL);
+            DSK_Chain *chain = get_chain(drv, dirent);
+            int grans = chain ? chain->count : 0;
 #if 1
-            dsk_printf("%8s %3s\t%d %c %d\n", file, ext, dirent->type, dirent->binary_ascii == 0 ? 'B' : 'A', grans);
+            dsk_printf(drv, "%8s %3s\t%d %c %d\n", file, ext, dirent->type, dirent->binary_ascii == 0 ? 'B' : 'A', grans);
 #else
-            dsk_printf("%8s %3s\t%d %c %d (%d bytes)\n", file, ext, dirent->type, dirent->binary_ascii == 0 ? 'B' : 'A', grans, file_size(drv, dirent));
+            dsk_printf(drv, "%8s %3s\t%d %c %d (%d bytes)\n", file, ext, dirent->type, dirent->binary_ascii == 0 ? 'B' : 'A', grans, file_size(drv, dirent));
             granule_chain(drv, dirent);
 #endif
         }
     }
 
-    dsk_printf("\n%d bytes (%d granules) free.\n", dsk_free_bytes(drv), dsk_free_granules(drv));
+    dsk_printf(drv, "\n%d bytes (%d granules) free.\n", dsk_free_bytes(drv), dsk_free_granules(drv));
 
     return E_OK;
 }
@@ -341,13 +893,13 @@ int dsk_dir(DSK_Drive *drv)
 //------------------------------------
 int dsk_seek_drive(DSK_Drive *drv, int track, int sector)
 {
-    assert(drv && drv->fp);
+    assert(drv && drv->drv_status == DSK_MOUNTED);
     assert(track >= 0 && track < drv->num_tracks);
     assert(sector >= 1 && sector <= DSK_SECTORS_PER_TRACK);
 
-    if (!drv || !drv->fp)
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("disk invalid\n");
+        dsk_printf(drv, "disk invalid\n");
         return E_FAIL;
     }
 
@@ -355,758 +907,4524 @@ int dsk_seek_drive(DSK_Drive *drv, int track, int sector)
     
     DSK_TRACE("seeking to track %d, sector %d, offset is %lX\n", track, sector, offset);
 
-    fseek(drv->fp, offset, SEEK_SET);
+    // memory drives have nothing to seek
+    if (drv->fp)
+        fseek(drv->fp, offset, SEEK_SET);
 
     return E_OK;
 }
 
 //------------------------------------
-// seek to track/sector for granule
+// map granule to its first track/sector
 //------------------------------------
-int dsk_seek_to_granule(DSK_Drive *drv, int granule)
+static void granule_to_track_sector(int granule, int *track, int *sector)
 {
-    assert(drv && drv->fp);
-    assert(granule >= 0 && granule <= DSK_LAST_GRANULE);
-
-    int track = granule / DSK_GRANULES_PER_TRACK;
+    *track = granule / DSK_GRANULES_PER_TRACK;
 
     // skip FAT/DIR track
-    if (granule >= DSK_DIR_START_GRANULE )
-        track++;
-    
-    assert(track != DSK_DIR_TRACK);
-    
-    int sector = 1 + (granule % DSK_GRANULES_PER_TRACK) * DSK_SECTORS_PER_GRANULE;
+    if (granule >= DSK_DIR_START_GRANULE)
+        (*track)++;
 
-    return dsk_seek_drive(drv, track, sector);
+    assert(*track != DSK_DIR_TRACK);
+
+    *sector = 1 + (granule % DSK_GRANULES_PER_TRACK) * DSK_SECTORS_PER_GRANULE;
 }
 
 //------------------------------------
-// print granule map for mounted drive
+// offset in DSK to start of granule
 //------------------------------------
-int dsk_granule_map(DSK_Drive *drv)
+static long dsk_granule_offset(DSK_Drive *drv, int granule)
 {
-    assert(drv && drv->fp);
-    if (!drv || !drv->fp)
-    {
-        dsk_printf("disk invalid\n");
-        return E_FAIL;
-    }
-
-    // print FAT
-    for (int i = 1; i <= DSK_TOTAL_GRANULES; i++)
-    {
-        dsk_printf("%02X ", drv->fat.granule_map[i-1]);
-        if (0 == (i%23))
-            dsk_printf("\n");
-    }
+    int track, sector;
 
-    dsk_printf("\n");
+    assert(granule >= 0 && granule < DSK_TOTAL_GRANULES);
 
-    return E_OK;
+    granule_to_track_sector(granule, &track, &sector);
+    return DSK_OFFSET(track, sector);
 }
 
 //------------------------------------
-// mount a DSK file
+// seek to track/sector for granule
 //------------------------------------
-DSK_Drive *dsk_mount_drive(const char *filename)
+int dsk_seek_to_granule(DSK_Drive *drv, int granule)
 {
-    DSK_Drive *drv;
+    int track, sector;
 
-    drv = malloc(sizeof(DSK_Drive));
-    
-    if (!drv)
-        return NULL;
-
-    memset(drv, 0, sizeof(DSK_Drive));
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    assert(granule >= 0 && granule <= DSK_LAST_GRANULE);
 
-    drv->fp = fopen(filename, "r+b");
-    if (!drv->fp)
-    {
-        dsk_printf("Disk (%s) not found.\n", filename);
-        free(drv);
-        return NULL;
-    }
+    granule_to_track_sector(granule, &track, &sector);
 
-    // check for headerless JVC files
-    if (!dsk_is_simple_file(drv))
-    {
-        dsk_printf("Disk (%s) invalid. Must be headerless.", filename);
-        fclose(drv->fp);
-        free(drv);
-        return NULL;
-    }
+    return dsk_seek_drive(drv, track, sector);
+}
 
-    // deduce tracks/sides from disk size
-    long file_size = dsk_get_file_size(drv);
-    int sectors = file_size / DSK_BYTES_DATA_PER_SECTOR;
+//------------------------------------
+// return pointer to track/sector in a mapped DSK
+//------------------------------------
+uint8_t *dsk_sector_ptr(DSK_Drive *drv, int track, int sector)
+{
+    assert(drv);
+    assert(track >= 0 && track < drv->num_tracks);
+    assert(sector >= 1 && sector <= DSK_SECTORS_PER_TRACK);
 
-    drv->num_tracks = sectors / DSK_SECTORS_PER_TRACK;  // 35
-    drv->num_sides = 1;
+    if (!drv || !drv->image)
+        return NULL;
 
-    // read in the FAT
-    dsk_seek_drive(drv, DSK_DIR_TRACK, DSK_FAT_SECTOR);
-    fread(&drv->fat, sizeof(DSK_FAT), 1, drv->fp);
+    return drv->image + DSK_OFFSET(track, sector);
+}
 
-    // read in the directory
-    dsk_seek_drive(drv, DSK_DIR_TRACK, DSK_DIRECTORY_SECTOR);
-    fread(&drv->dirs, sizeof(DSK_DirEntry), DSK_MAX_DIR_ENTRIES, drv->fp);
+//------------------------------------
+// return pointer to granule data in a mapped DSK
+//------------------------------------
+uint8_t *dsk_granule_ptr(DSK_Drive *drv, int granule)
+{
+    assert(drv);
 
-    // save the DSK filename
-    strcpy(drv->filename, filename);
-    
-    drv->drv_status = DSK_MOUNTED;
+    if (!drv || !drv->image)
+        return NULL;
 
-    return drv;
+    return drv->image + dsk_granule_offset(drv, granule);
 }
 
 //------------------------------------
-// unmount a DSK file
+// read bytes from the DSK file at offset without seeking
 //------------------------------------
-int dsk_unmount_drive(DSK_Drive *drv)
+static int image_pread(DSK_Drive *drv, long offset, void *buf, size_t size)
 {
-    if (!drv || !drv->fp)
-    {
-        dsk_printf("no disk mounted.\n");
+#ifdef DSK_HAVE_PREAD
+    if (pread(fileno(drv->fp), buf, size, offset) != (ssize_t)size)
         return E_FAIL;
-    }
+#else
+    fseek(drv->fp, offset, SEEK_SET);
+    if (size && fread(buf, size, 1, drv->fp) != 1)
+        return E_FAIL;
+#endif
 
-    // ensure any changes are written!
-    dsk_flush(drv);
+    return E_OK;
+}
 
-    // fflush(drv->fp);
-    fclose(drv->fp);
-    
-    drv->fp = NULL;
-    drv->drv_status = DSK_UNMOUNTED;
-    free(drv);
+//------------------------------------
+// write bytes to the DSK file at offset without seeking
+//------------------------------------
+static int image_pwrite(DSK_Drive *drv, long offset, const void *buf, size_t size)
+{
+#ifdef DSK_HAVE_PREAD
+    if (pwrite(fileno(drv->fp), buf, size, offset) != (ssize_t)size)
+        return E_FAIL;
+#else
+    fseek(drv->fp, offset, SEEK_SET);
+    if (size && fwrite(buf, size, 1, drv->fp) != 1)
+        return E_FAIL;
+#endif
 
     return E_OK;
 }
 
 //------------------------------------
-// find and return a free dir entry
+// write a cached track back to the DSK file
 //------------------------------------
-static DSK_DirEntry *find_free_dir_entry(DSK_Drive *drv)
+static int cache_write_back(DSK_Drive *drv, DSK_CacheEntry *entry)
 {
-    assert(drv && drv->fp);
-    if (!drv || !drv->fp)
-    {
-        dsk_printf("disk invalid\n");
-        return NULL;
-    }
+    if (entry->track < 0 || !entry->dirty)
+        return E_OK;
 
-    // find dir entry
-    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
-    {
-        DSK_DirEntry *dirent = &drv->dirs[i];
+    DSK_TRACE("writing back track %d\n", entry->track);
 
-        if (dirent->filename[0] == DSK_DIRENT_DELETED || DSK_DIRENT_FREE == (uint8_t)dirent->filename[0])
-            return dirent;
-    }
+    if (image_pwrite(drv, DSK_TRACK_OFFSET(entry->track), entry->data, DSK_BYTES_DATA_PER_TRACK))
+        return E_FAIL;
 
-    return NULL;
+    entry->dirty = 0;
+    drv->cache_stats.writebacks++;
+
+    return E_OK;
 }
 
 //------------------------------------
-// uppercase the string
+// write all dirty cached tracks to the DSK file
 //------------------------------------
-static char *string_upper(char *s)
+static int cache_flush(DSK_Drive *drv)
 {
-    char *pstr = s;
+    int result = E_OK;
 
-    for (; *s; s++)
+    for (int i = 0; i < drv->cache_size; i++)
     {
-        *s = toupper(*s);
+        if (cache_write_back(drv, &drv->cache[i]))
+            result = E_FAIL;
     }
 
-    return pstr;
+    return result;
 }
 
 //------------------------------------
-// return the first free granule
+// return cache entry for track, loading it if needed
+// if overwrite is set the caller replaces the whole track
 //------------------------------------
-static int find_first_free_granule(DSK_Drive *drv)
+static DSK_CacheEntry *cache_get_track(DSK_Drive *drv, int track, int overwrite)
 {
-    for (int i = 0; i < DSK_TOTAL_GRANULES; i++)
+    DSK_CacheEntry *victim = &drv->cache[0];
+
+    drv->cache_clock++;
+
+    for (int i = 0; i < drv->cache_size; i++)
     {
-        if (drv->fat.granule_map[i] == DSK_GRANULE_FREE)
+        DSK_CacheEntry *entry = &drv->cache[i];
+
+        if (entry->track == track)
         {
-            DSK_TRACE("returning free granule: %d\n", i);
-            return i;
+            drv->cache_stats.hits++;
+            entry->last_used = drv->cache_clock;
+            return entry;
         }
+
+        // prefer unused entries, then least recently used
+        if (victim->track >= 0 && (entry->track < 0 || entry->last_used < victim->last_used))
+            victim = entry;
     }
 
-    return -1;
+    drv->cache_stats.misses++;
+
+    if (cache_write_back(drv, victim))
+        return NULL;
+
+    victim->track = -1;
+
+    if (!overwrite)
+    {
+        if (image_pread(drv, DSK_TRACK_OFFSET(track), victim->data, DSK_BYTES_DATA_PER_TRACK))
+            return NULL;
+    }
+
+    victim->track = track;
+    victim->dirty = 0;
+    victim->last_used = drv->cache_clock;
+
+    return victim;
 }
 
 //------------------------------------
-// Convert host line endings to CoCo CR format (for adding files to DSK)
-// Handles CRLF -> CR and LF -> CR. Returns new size (may shrink).
+// copy to/from the track cache
 //------------------------------------
-size_t translate_to_coco(char *blk, size_t size)
+static int cache_io(DSK_Drive *drv, long offset, void *buf, size_t size, int write)
 {
-    size_t j = 0;
-    for (size_t i = 0; i < size; i++)
+    char *p = buf;
+
+    while (size)
     {
-        if (blk[i] == 0x0d && i + 1 < size && blk[i + 1] == 0x0a)
-        {
-            // CRLF -> CR (skip the LF)
-            blk[j++] = 0x0d;
-            i++;  // skip LF
-        }
-        else if (blk[i] == 0x0a)
+        int track = offset / DSK_BYTES_DATA_PER_TRACK;
+        size_t pos = offset % DSK_BYTES_DATA_PER_TRACK;
+        size_t count = DSK_BYTES_DATA_PER_TRACK - pos;
+
+        if (count > size)
+            count = size;
+
+        DSK_CacheEntry *entry = cache_get_track(drv, track, write && count == DSK_BYTES_DATA_PER_TRACK);
+        if (!entry)
+            return E_FAIL;
+
+        if (write)
         {
-            // standalone LF -> CR
-            blk[j++] = 0x0d;
+            memcpy(entry->data + pos, p, count);
+            entry->dirty = 1;
         }
         else
         {
-            blk[j++] = blk[i];
+            memcpy(p, entry->data + pos, count);
         }
+
+        p += count;
+        offset += count;
+        size -= count;
     }
-    return j;
+
+    return E_OK;
 }
 
 //------------------------------------
-// Convert CoCo CR to host line endings (for extracting files from DSK)
-// On Windows: CR -> CRLF (expands). On Unix: CR -> LF (same size).
-// dst must have room for expansion (up to 2x size on Windows).
-// Returns new size.
+// read bytes from the DSK image at offset
 //------------------------------------
-size_t translate_from_coco(char *dst, const char *src, size_t size)
+static int dsk_read_image(DSK_Drive *drv, long offset, void *buf, size_t size)
 {
-    size_t j = 0;
-    for (size_t i = 0; i < size; i++)
+    assert(offset >= 0 && offset + (long)size <= DSK_TOTAL_SIZE);
+
+    if (drv->image)
     {
-        if (src[i] == 0x0d)
-        {
-#ifdef _WIN32
-            // CR -> CRLF on Windows
-            dst[j++] = 0x0d;
-            dst[j++] = 0x0a;
-#else
-            // CR -> LF on Unix
-            dst[j++] = 0x0a;
-#endif
-        }
-        else
-        {
-            dst[j++] = src[i];
-        }
+        if (offset + (long)size > drv->image_size)
+            return E_FAIL;
+
+        memcpy(buf, drv->image + offset, size);
+        return E_OK;
     }
-    return j;
+
+#ifdef DSK_HAVE_PREAD
+    if (!drv->cache)
+        return image_pread(drv, offset, buf, size);
+#endif
+
+    // the cache and the stdio file offset are shared by readers
+    state_lock(drv);
+    int result = drv->cache ? cache_io(drv, offset, buf, size, FALSE) : image_pread(drv, offset, buf, size);
+    state_unlock(drv);
+
+    return result;
 }
 
 //------------------------------------
-// add file to a mounted DSK file
+// return TRUE, with a message, if drv cannot be changed
 //------------------------------------
-int dsk_add_file(DSK_Drive *drv, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+static int read_only(DSK_Drive *drv)
 {
-    char dest_filename[DSK_MAX_FILENAME + DSK_MAX_EXT + 2];
+    if (!drv || !drv->read_only)
+        return FALSE;
 
-    assert(drv && drv->fp);
-    if (!drv || !drv->fp)
-    {
-        dsk_printf("disk invalid.\n");
+    dsk_printf(drv, "disk is read only.\n");
+    return TRUE;
+}
+
+//------------------------------------
+// write bytes to the DSK image at offset
+//------------------------------------
+static int dsk_write_image(DSK_Drive *drv, long offset, const void *buf, size_t size)
+{
+    assert(!drv->read_only);
+    if (read_only(drv))
         return E_FAIL;
-    }
 
-    // get dest filename and ensure upper case
-    strcpy(dest_filename, dsk_basename(filename));
-    string_upper(dest_filename);
-    DSK_TRACE("adding file '%s'\n", dest_filename);
+    assert(offset >= 0 && offset + (long)size <= DSK_TOTAL_SIZE);
 
-    // check filename.ext length (check basename, not full path)
-    if (strlen(dest_filename) > DSK_MAX_FILENAME + DSK_MAX_EXT + 1)
+    if (drv->image)
     {
-        dsk_printf("filename '%s' is too long.\n", dest_filename);
-        return E_FAIL;
-    }
+        if (offset + (long)size > drv->image_size)
+            return E_FAIL;
 
-    // always open in binary mode for consistent behavior
-    FILE *fin = fopen(filename, "rb");
-    if (!fin)
-    {
-        dsk_printf("file not found.\n");
-        return E_FAIL;
+        memcpy(drv->image + offset, buf, size);
+        return E_OK;
     }
 
-    // get the file size
-    fseek(fin, 0, SEEK_END);
-    long fin_size = ftell(fin);
-    fseek(fin, 0, SEEK_SET);
+#ifdef DSK_HAVE_PREAD
+    if (!drv->cache)
+        return image_pwrite(drv, offset, buf, size);
+#endif
+
+    state_lock(drv);
+    int result = drv->cache ? cache_io(drv, offset, (void *)buf, size, TRUE) : image_pwrite(drv, offset, buf, size);
+    state_unlock(drv);
+
+    return result;
+}
 
-    // read entire file into memory
-    char *file_data = malloc(fin_size);
-    if (!file_data)
+//------------------------------------
+// set number of tracks held in the write-back cache, 0 disables it
+//------------------------------------
+static int set_cache_size_locked(DSK_Drive *drv, int tracks)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("out of memory.\n");
-        fclose(fin);
+        dsk_printf(drv, "disk invalid.\n");
         return E_FAIL;
     }
-    fread(file_data, 1, fin_size, fin);
-    fclose(fin);
 
-    // translate line endings for ASCII mode
-    long data_size = fin_size;
-    if (mode == DSK_MODE_ASCII)
-    {
-        data_size = (long)translate_to_coco(file_data, fin_size);
-    }
+    // mapped images are already in memory
+    if (drv->image)
+        return E_OK;
+
+    if (tracks < 0)
+        tracks = 0;
 
-    // check that disk has space for translated file
-    if (data_size > dsk_free_bytes(drv))
+    if (tracks > drv->num_tracks)
+        tracks = drv->num_tracks;
+
+    // write back and drop the current cache
+    if (drv->cache)
     {
-        dsk_printf("out of space.\n");
-        free(file_data);
-        return E_FAIL;
+        if (cache_flush(drv))
+            return E_FAIL;
+
+        free(drv->cache);
+        drv->cache = NULL;
+        drv->cache_size = 0;
     }
 
-    // see if file already exists on DSK
-    DSK_DirEntry *dirent = find_file_in_dir(drv, dest_filename);
-    if (dirent)
+    if (!tracks)
+        return E_OK;
+
+    drv->cache = malloc(tracks * sizeof(DSK_CacheEntry));
+    if (!drv->cache)
     {
-        dsk_printf("file already exists.\n");
-        free(file_data);
+        dsk_printf(drv, "out of memory.\n");
         return E_FAIL;
     }
 
-    // find first free directory entry
-    dirent = find_free_dir_entry(drv);
-    if (!dirent)
+    for (int i = 0; i < tracks; i++)
     {
-        dsk_printf("drive is full.\n");
-        free(file_data);
-        return E_FAIL;
+        drv->cache[i].track = -1;
+        drv->cache[i].dirty = 0;
+        drv->cache[i].last_used = 0;
     }
 
-    // update directory entry
-    char *basefile = strtok(dest_filename, ".");
-    char *ext = strtok(NULL, "");
+    drv->cache_size = tracks;
 
-    // copy in the filename, left justified, padded with spaces
-    for (int i = 0; i < DSK_MAX_FILENAME; i++)
-    {
-        if (i < strlen(basefile))
-            dirent->filename[i]= basefile[i];
-        else
-            dirent->filename[i] = ' ';
-    }
+    return E_OK;
+}
 
-    // copy in the extension, left justified, padded with spaces
-    for (int i = 0; i < DSK_MAX_EXT; i++)
-    {
-        if (ext && i < strlen(ext))
-            dirent->ext[i] = ext[i];
-        else
-            dirent->ext[i] = ' ';
-    }
+//------------------------------------
+// return track cache statistics
+//------------------------------------
+static int cache_stats_locked(DSK_Drive *drv, DSK_CacheStats *stats)
+{
+    assert(drv && stats);
+    if (!drv || !stats)
+        return E_FAIL;
 
-    DSK_TRACE("%s -> file: %s, ext: %s\n", dest_filename, basefile, ext ? ext : "");
-    
-    dirent->binary_ascii = (mode == DSK_MODE_ASCII) ? DSK_ENCODING_ASCII : DSK_ENCODING_BINARY;
-    dirent->type = type;
+    state_lock(drv);
+    *stats = drv->cache_stats;
+    state_unlock(drv);
+
+    return E_OK;
+}
 
-    // find first free granule
-    int next_gran, gran = find_first_free_granule(drv);
-    dirent->first_granule = gran;
+//------------------------------------
+// measure the layout of a granule chain
+//------------------------------------
+static void chain_layout(DSK_Chain *chain, DSK_FileLayout *layout)
+{
+    int prev_track = -1, track, sector;
 
-    // write data to DSK from translated buffer
-    char *data_ptr = file_data;
-    long remaining = data_size;
+    memset(layout, 0, sizeof(DSK_FileLayout));
+    layout->granules = chain->count;
 
-    // copy full granule data
-    for (; remaining >= DSK_BYTES_PER_GRANULE; remaining -= DSK_BYTES_PER_GRANULE)
+    for (int i = 0; i < chain->count; i++)
     {
-        dsk_seek_to_granule(drv, gran);
-        for (int sector = 0; sector < DSK_SECTORS_PER_GRANULE; sector++)
-        {
-            fwrite(data_ptr, DSK_BYTES_DATA_PER_SECTOR, 1, drv->fp);
-            data_ptr += DSK_BYTES_DATA_PER_SECTOR;
-        }
+        int gran = chain->granules[i];
 
-        // temporarily mark this granule as used so find chooses next avail
-        drv->fat.granule_map[gran] = 0xC0;
+        // granules either side of the DIR track count as consecutive
+        if (i == 0 || gran != chain->granules[i - 1] + 1)
+            layout->extents++;
 
-        // find next available granule
-        next_gran = find_first_free_granule(drv);
-
-        // patch current granule to point to next granule
-        drv->fat.granule_map[gran] = next_gran;
-        gran = next_gran;
+        granule_to_track_sector(gran, &track, &sector);
+        if (prev_track >= 0)
+            layout->seek_tracks += abs(track - prev_track);
+        prev_track = track;
     }
+}
 
-    // find number of sectors used in last granule
-    int tail_sectors = remaining / DSK_BYTES_DATA_PER_SECTOR;
-    int extra_bytes = remaining % DSK_BYTES_DATA_PER_SECTOR;
-    DSK_TRACE("data_size: %ld, tail sectors: %d, extra bytes: %d\n", data_size, tail_sectors, extra_bytes);
-
-    dsk_seek_to_granule(drv, gran);
-    for (int sector = 0; sector < tail_sectors; sector++)
+//------------------------------------
+// return the stored size of a file in bytes
+//------------------------------------
+static long file_size_locked(DSK_Drive *drv, const char *filename)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        fwrite(data_ptr, DSK_BYTES_DATA_PER_SECTOR, 1, drv->fp);
-        data_ptr += DSK_BYTES_DATA_PER_SECTOR;
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
     }
 
-    if (extra_bytes > 0)
+    DSK_DirEntry *dirent = find_file_in_dir(drv, filename);
+    if (!dirent)
     {
-        fwrite(data_ptr, extra_bytes, 1, drv->fp);
+        dsk_printf(drv, "file not found.\n");
+        return E_FAIL;
     }
-    
-    // mark last granule
-    drv->fat.granule_map[gran] = 0xC0 + tail_sectors + (extra_bytes > 0);
-
-    // update bytes in last sector, respecting endianness
-    dirent->bytes_in_last_sector = htons(extra_bytes);
-
-    free(file_data);
-
-    // update DSK image
-    drv->dirty_flag = 1;
-    dsk_flush(drv);
 
-    return E_OK;
+    return file_size(drv, dirent);
 }
 
 //------------------------------------
-// extract a file from the DSK
+// return layout statistics for a file
 //------------------------------------
-int dsk_extract_file(DSK_Drive *drv, const char *filename)
+static int file_layout_locked(DSK_Drive *drv, const char *filename, DSK_FileLayout *layout)
 {
-    char sector_data[DSK_BYTES_DATA_PER_SECTOR];
-    // on Windows, CR->CRLF can double the size
-    char output_data[DSK_BYTES_DATA_PER_SECTOR * 2];
-
-    assert(drv && drv->fp);
-    if (!drv || !drv->fp)
+    assert(drv && drv->drv_status == DSK_MOUNTED && layout);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("disk invalid.\n");
+        dsk_printf(drv, "disk invalid.\n");
         return E_FAIL;
     }
 
     DSK_DirEntry *dirent = find_file_in_dir(drv, filename);
     if (!dirent)
     {
-        dsk_printf("file not found.\n");
+        dsk_printf(drv, "file not found.\n");
         return E_FAIL;
     }
 
-    // always open in binary mode for consistent behavior
-    FILE *fout = fopen(filename, "wb");
-    if (!fout)
-    {
-        dsk_printf("cannot create file.\n");
+    DSK_Chain *chain = get_chain(drv, dirent);
+    if (!chain)
         return E_FAIL;
-    }
 
-    int is_ascii = (dirent->binary_ascii == DSK_ENCODING_ASCII);
+    chain_layout(chain, layout);
 
-    // walk the granules
-    int gran = dirent->first_granule;
+    return E_OK;
+}
 
-    // write out full granules    
-    while(!DSK_IS_LAST_GRANULE(drv->fat.granule_map[gran]))
-    {
-        int track = gran / DSK_GRANULES_PER_TRACK;
-        int sector = 1 + (gran % DSK_GRANULES_PER_TRACK) * DSK_SECTORS_PER_GRANULE;
+//------------------------------------
+// return layout statistics for the whole DSK
+//------------------------------------
+static int layout_locked(DSK_Drive *drv, DSK_Layout *layout)
+{
+    DSK_FileLayout file;
 
-        DSK_TRACE("t: %d, s: %d\n", track, sector);
-        dsk_seek_drive(drv, track, sector);
+    assert(drv && drv->drv_status == DSK_MOUNTED && layout);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
 
-        DSK_TRACE("extracting granule %2X\n", gran);
-        for (int i = 0; i < DSK_SECTORS_PER_GRANULE; i++)
-        {
-            fread(sector_data, DSK_BYTES_DATA_PER_SECTOR, 1, drv->fp);
-            if (is_ascii)
-            {
-                size_t out_size = translate_from_coco(output_data, sector_data, DSK_BYTES_DATA_PER_SECTOR);
-                fwrite(output_data, out_size, 1, fout);
-            }
-            else
-            {
-                fwrite(sector_data, DSK_BYTES_DATA_PER_SECTOR, 1, fout);
-            }
-        }
+    memset(layout, 0, sizeof(DSK_Layout));
 
-        // get next granule
-        gran = drv->fat.granule_map[gran];
-    }
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        DSK_DirEntry *dirent = &drv->dirs[i];
 
-    // write out partial granule
-    int next_gran = drv->fat.granule_map[gran];
-    int tail_sectors = (next_gran & DSK_SECTOR_COUNT_MASK);
-    int bytes_in_last_sector = ntohs(dirent->bytes_in_last_sector);
+        if (!dir_entry_in_use(dirent))
+            continue;
 
-    DSK_TRACE("tail sectors in granule %02X: %d\n", gran, tail_sectors);
+        DSK_Chain *chain = get_chain(drv, dirent);
+        if (!chain)
+            return E_FAIL;
 
-    // extract full sectors
-    if (bytes_in_last_sector)
-        tail_sectors--;
+        chain_layout(chain, &file);
 
-    dsk_seek_to_granule(drv, gran);
-    for (int i = 0; i < tail_sectors; i++)
-    {
-        fread(sector_data, DSK_BYTES_DATA_PER_SECTOR, 1, drv->fp);
-        if (is_ascii)
-        {
-            size_t out_size = translate_from_coco(output_data, sector_data, DSK_BYTES_DATA_PER_SECTOR);
-            fwrite(output_data, out_size, 1, fout);
-        }
-        else
-        {
-            fwrite(sector_data, DSK_BYTES_DATA_PER_SECTOR, 1, fout);
-        }
+        layout->files++;
+        layout->used_granules += file.granules;
+        layout->extents += file.extents;
+        layout->seek_tracks += file.seek_tracks;
+        if (file.extents > 1)
+            layout->fragmented_files++;
     }
 
-    // extract partial sector
-    DSK_TRACE("bytes in last sector: %d\n", bytes_in_last_sector);
-
-    if (bytes_in_last_sector)
+    // runs of free granules from the free map
+    int run = 0;
+    for (int gran = 0; gran <= DSK_TOTAL_GRANULES; gran++)
     {
-        fread(sector_data, bytes_in_last_sector, 1, drv->fp);
-        if (is_ascii)
+        if (gran < DSK_TOTAL_GRANULES && granule_is_free(drv, gran))
         {
-            size_t out_size = translate_from_coco(output_data, sector_data, bytes_in_last_sector);
-            fwrite(output_data, out_size, 1, fout);
+            run++;
+            continue;
         }
-        else
+
+        if (run)
         {
-            fwrite(sector_data, bytes_in_last_sector, 1, fout);
+            layout->free_runs++;
+            if (run > layout->largest_free_run)
+                layout->largest_free_run = run;
         }
+
+        run = 0;
     }
 
-    fclose(fout);
+    layout->free_granules = drv->free_granules;
 
     return E_OK;
 }
 
 //------------------------------------
-// delete file from mounted DSK
+// print granule map for mounted drive
 //------------------------------------
-int dsk_del(DSK_Drive *drv, const char *filename)
+static int granule_map_locked(DSK_Drive *drv)
 {
-    assert(drv && drv->fp);
-    if (!drv || !drv->fp)
-    {
-        dsk_printf("disk invalid.\n");
-        return E_FAIL;
-    }
-
-    DSK_DirEntry *dirent = find_file_in_dir(drv, filename);
-    if (!dirent)
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("file '%s' not found.\n", filename);
+        dsk_printf(drv, "disk invalid\n");
         return E_FAIL;
     }
 
-    // mark all file granules as free
-    int gran = dirent->first_granule;
-    while (!DSK_IS_LAST_GRANULE(gran))
+    // print FAT
+    for (int i = 1; i <= DSK_TOTAL_GRANULES; i++)
     {
-        int next_gran = drv->fat.granule_map[gran];
-        DSK_TRACE("marking granule %2X as free.\n", gran);
-        drv->fat.granule_map[gran] = DSK_GRANULE_FREE;
-        gran = next_gran;
+        dsk_printf(drv, "%02X ", drv->fat.granule_map[i-1]);
+        if (0 == (i%23))
+            dsk_printf(drv, "\n");
     }
 
-    // mark the dir entry as freed
-    dirent->filename[0] = DSK_DIRENT_DELETED;
-
-    drv->dirty_flag = 1;
-
-    dsk_flush(drv);
+    dsk_printf(drv, "\n");
 
     return E_OK;
 }
 
 //------------------------------------
-// create a new DSK file
+// read or write count metadata sectors starting at first, where
+// sector 0 is the FAT and 1 onwards the directory. The sectors are
+// contiguous on the DIR track so a plain DSK file needs one syscall.
 //------------------------------------
-DSK_Drive *dsk_new(char *filename, int tracks, int sides)
+static int metadata_io(DSK_Drive *drv, int first, int count, int write)
 {
-    char sector_data[DSK_BYTES_DATA_PER_SECTOR];
+    long offset = DSK_OFFSET(DSK_DIR_TRACK, DSK_FAT_SECTOR + first);
+    uint8_t *part[2];
+    size_t len[2];
+    int parts = 0;
 
-    assert(filename);
-
-    // TODO - check filename and ext length
-
-    // ensure upper case
-    string_upper(filename);
+    assert(first >= 0 && count > 0 && first + count <= DSK_METADATA_SECTORS);
 
-    FILE *fout = fopen(filename, "wb");
-    if (!fout)
+    // FAT sector, then directory sectors which are contiguous in memory
+    if (first == 0)
     {
-        dsk_printf("file not found.\n");
-        return NULL;
+        part[parts] = drv->fat.granule_map;
+        len[parts++] = DSK_BYTES_DATA_PER_SECTOR;
+        first++;
+        count--;
     }
 
-    // write out empty DSK
-    memset(sector_data, 0, DSK_BYTES_DATA_PER_SECTOR);
-
-    for (int track = 0; track < tracks * sides; track++)
+    if (count)
     {
-        for (int sector = 0; sector < DSK_SECTORS_PER_TRACK; sector++)
-            fwrite(sector_data, sizeof(sector_data), 1, fout);
+        part[parts] = (uint8_t *)drv->dirs + (first - 1) * DSK_BYTES_DATA_PER_SECTOR;
+        len[parts++] = count * DSK_BYTES_DATA_PER_SECTOR;
     }
 
-    fclose(fout);
-
-    // mount it
-    DSK_Drive *drv = dsk_mount_drive(filename);
-    if (!drv)
+#ifdef DSK_HAVE_PREAD
+    if (!drv->image && !drv->cache)
     {
-        dsk_printf("disk not found.\n");
-        return NULL;
-    }
+        struct iovec iov[2];
+        ssize_t total = 0;
 
-    // format it
-    dsk_format(drv);
+        for (int i = 0; i < parts; i++)
+        {
+            iov[i].iov_base = part[i];
+            iov[i].iov_len = len[i];
+            total += len[i];
+        }
 
-    return drv;
-}
+        ssize_t n = write ? pwritev(fileno(drv->fp), iov, parts, offset) : preadv(fileno(drv->fp), iov, parts, offset);
 
-//------------------------------------
-// write the FAT and DIR to the DSK
-//------------------------------------
-int dsk_flush(DSK_Drive *drv)
-{
-    assert(drv && drv->fp);
-    if (!drv || !drv->fp)
-    {
-        dsk_printf("disk invalid.\n");
-        return E_FAIL;
+        return n == total ? E_OK : E_FAIL;
     }
+#endif
 
-    // don't flush if nothing has changed
-    if (!drv->dirty_flag)
-    {
-        DSK_TRACE("flush called with no changes.\n");
-        return E_OK;
-    } else
+    for (int i = 0; i < parts; i++)
     {
-        DSK_TRACE("flushing dirty file.\n");
-    }
+        int result = write ? dsk_write_image(drv, offset, part[i], len[i]) : dsk_read_image(drv, offset, part[i], len[i]);
+        if (result)
+            return E_FAIL;
 
-    // write out the FAT
-    dsk_seek_drive(drv, DSK_DIR_TRACK, DSK_FAT_SECTOR);
-    fwrite(drv->fat.granule_map, 1, DSK_TOTAL_GRANULES, drv->fp);
-
-    // write out the Directory
-    dsk_seek_drive(drv, DSK_DIR_TRACK, DSK_DIRECTORY_SECTOR);
-    fwrite(drv->dirs, sizeof(DSK_DirEntry), DSK_MAX_DIR_ENTRIES, drv->fp);
-
-    // clear dirty flag
-    drv->dirty_flag = 0;
+        offset += len[i];
+    }
 
     return E_OK;
 }
 
 //------------------------------------
-// format a mounted drive
+// return metadata sector n as held in memory, see metadata_io
 //------------------------------------
-int dsk_format(DSK_Drive *drv)
+static const uint8_t *metadata_sector(DSK_Drive *drv, int n)
 {
-    assert(drv && drv->fp);
-    if (!drv || !drv->fp)
-    {
-        dsk_printf("disk invalid.\n");
+    if (n == 0)
+        return drv->fat.granule_map;
+
+    return (const uint8_t *)drv->dirs + (n - 1) * DSK_BYTES_DATA_PER_SECTOR;
+}
+
+//------------------------------------
+// note metadata sectors first..first+count-1 now match the DSK
+//------------------------------------
+static void update_metadata_shadow(DSK_Drive *drv, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+        memcpy(drv->meta_shadow[i], metadata_sector(drv, i), DSK_BYTES_DATA_PER_SECTOR);
+}
+
+//------------------------------------
+// read in the FAT and directory and build the in-memory indexes
+//------------------------------------
+static int load_metadata(DSK_Drive *drv)
+{
+    // read in the FAT and directory together
+    if (metadata_io(drv, 0, DSK_METADATA_SECTORS, FALSE))
+    {
+        dsk_printf(drv, "error reading directory.\n");
         return E_FAIL;
     }
 
-    // clear FAT granule entries
-    for (int i = 0; i < DSK_TOTAL_GRANULES; i++)
-        drv->fat.granule_map[i] = DSK_GRANULE_FREE;
+    update_metadata_shadow(drv, 0, DSK_METADATA_SECTORS);
 
-    // zero other FAT entries
-    for (int i = DSK_TOTAL_GRANULES; i < DSK_BYTES_DATA_PER_SECTOR; i++)
-        drv->fat.granule_map[i] = 0;
+    build_free_map(drv);
+    build_dir_index(drv);
 
-    // clear Directory entries
-    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
-        drv->dirs[i].filename[0] = DSK_DIRENT_FREE;
+    return E_OK;
+}
 
-    // flush changes to DSK file
-    drv->dirty_flag = 1;
-    dsk_flush(drv);
+//------------------------------------
+// mount a DSK file
+//------------------------------------
+DSK_Drive *dsk_mount_drive(const char *filename)
+{
+    return dsk_mount_drive_ex(filename, DSK_MOUNT_DEFAULT);
+}
 
-    return E_OK;
+//------------------------------------
+// mount a DSK file with options
+//------------------------------------
+DSK_Drive *dsk_mount_drive_ex(const char *filename, int flags)
+{
+    DSK_Drive *drv;
+
+    drv = malloc(sizeof(DSK_Drive));
+    
+    if (!drv)
+        return NULL;
+
+    memset(drv, 0, sizeof(DSK_Drive));
+
+    if (drive_lock_init(drv))
+    {
+        dsk_printf(drv, "out of memory.\n");
+        free(drv);
+        return NULL;
+    }
+
+    drv->fp = fopen(filename, "r+b");
+    if (!drv->fp)
+    {
+        dsk_printf(drv, "Disk (%s) not found.\n", filename);
+        drive_lock_free(drv);
+        free(drv);
+        return NULL;
+    }
+
+    // check for headerless JVC files
+    if (!dsk_is_simple_file(drv))
+    {
+        dsk_printf(drv, "Disk (%s) invalid. Must be headerless.", filename);
+        fclose(drv->fp);
+        drive_lock_free(drv);
+        free(drv);
+        return NULL;
+    }
+
+    // deduce tracks/sides from disk size
+    long file_size = dsk_get_file_size(drv);
+    int sectors = file_size / DSK_BYTES_DATA_PER_SECTOR;
+
+    drv->num_tracks = sectors / DSK_SECTORS_PER_TRACK;  // 35
+    drv->num_sides = 1;
+
+    // the image must at least hold the DIR/FAT track
+    if (file_size % DSK_BYTES_DATA_PER_TRACK || drv->num_tracks < DSK_MIN_TRACKS)
+    {
+        dsk_printf(drv, "Disk (%s) invalid. Must be headerless.\n", filename);
+        fclose(drv->fp);
+        drive_lock_free(drv);
+        free(drv);
+        return NULL;
+    }
+
+    // the FAT, free map and chains are sized for at most DSK_MAX_TRACKS
+    if (drv->num_tracks > DSK_MAX_TRACKS)
+    {
+        dsk_printf(drv, "Disk (%s) invalid. Too many tracks.\n", filename);
+        fclose(drv->fp);
+        drive_lock_free(drv);
+        free(drv);
+        return NULL;
+    }
+
+#ifdef DSK_HAVE_MMAP
+    // map the whole image, falling back to stdio if that fails
+    if ((flags & DSK_MOUNT_MMAP) && file_size > 0)
+    {
+        void *p = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(drv->fp), 0);
+        if (p != MAP_FAILED)
+        {
+            drv->image = p;
+            drv->image_size = file_size;
+        }
+        else
+        {
+            DSK_TRACE("unable to map '%s', using stdio.\n", filename);
+        }
+    }
+#endif
+
+    // save the DSK filename
+    strcpy(drv->filename, filename);
+    
+    drv->drv_status = DSK_MOUNTED;
+
+    // nothing has been changed yet, so don't flush
+    if (load_metadata(drv))
+    {
+#ifdef DSK_HAVE_MMAP
+        if (drv->image)
+            munmap(drv->image, drv->image_size);
+#endif
+        fclose(drv->fp);
+        drive_lock_free(drv);
+        free(drv);
+        return NULL;
+    }
+
+    // refuse damaged images rather than risk walking bad chains
+    if ((flags & DSK_MOUNT_CHECK) && dsk_check(drv, FALSE))
+    {
+        dsk_printf(drv, "Disk (%s) failed check.\n", filename);
+        dsk_unmount_drive(drv);
+        return NULL;
+    }
+
+    return drv;
 }
 
 //------------------------------------
-// rename file1 to file2
+// return the number of tracks in a headerless image, 0 if invalid
 //------------------------------------
-int dsk_rename(DSK_Drive *drv, char *current_file, char *new_file)
+static int image_tracks(long size)
 {
-    string_upper(current_file);
-    string_upper(new_file);
+    int tracks = size / DSK_BYTES_DATA_PER_TRACK;
 
-    if (strlen(new_file) > DSK_MAX_FILENAME + DSK_MAX_EXT + 1)
+    if (size % DSK_BYTES_DATA_PER_TRACK || tracks < DSK_MIN_TRACKS || tracks > DSK_MAX_TRACKS)
     {
-        dsk_printf("filename too long.\n");
-        return E_FAIL;
+        dsk_printf(NULL, "Disk image invalid. Must be headerless.\n");
+        return 0;
     }
 
-    // ensure current file exists
-    DSK_DirEntry *dirent1 = find_file_in_dir(drv, current_file);
-    if (!dirent1)
+    return tracks;
+}
+
+//------------------------------------
+// mount an image that is already in memory
+// read only drives borrow the image, other drives own it
+//------------------------------------
+static DSK_Drive *mount_image(uint8_t *image, long size, int read_only)
+{
+    DSK_Drive *drv = malloc(sizeof(DSK_Drive));
+    if (!drv)
+    {
+        dsk_printf(NULL, "out of memory.\n");
+        return NULL;
+    }
+
+    memset(drv, 0, sizeof(DSK_Drive));
+
+    if (drive_lock_init(drv))
+    {
+        dsk_printf(drv, "out of memory.\n");
+        free(drv);
+        return NULL;
+    }
+
+    drv->image = image;
+    drv->image_size = size;
+    drv->read_only = read_only;
+    drv->num_tracks = size / DSK_BYTES_DATA_PER_TRACK;
+    drv->num_sides = 1;
+
+    if (load_metadata(drv))
+    {
+        drive_lock_free(drv);
+        free(drv);
+        return NULL;
+    }
+
+    drv->drv_status = DSK_MOUNTED;
+
+    return drv;
+}
+
+//------------------------------------
+// mount a copy of a DSK image held in memory
+// the drive has no backing file, use dsk_save to write it out
+//------------------------------------
+DSK_Drive *dsk_mount_memory(const void *image, long size)
+{
+    assert(image);
+    if (!image || !image_tracks(size))
+        return NULL;
+
+    uint8_t *copy = malloc(size);
+    if (!copy)
+    {
+        dsk_printf(NULL, "out of memory.\n");
+        return NULL;
+    }
+
+    memcpy(copy, image, size);
+
+    DSK_Drive *drv = mount_image(copy, size, FALSE);
+    if (!drv)
+        free(copy);
+
+    return drv;
+}
+
+//------------------------------------
+// create a new formatted DSK image in memory
+//------------------------------------
+DSK_Drive *dsk_new_memory(int tracks, int sides)
+{
+    long size = (long)tracks * sides * DSK_BYTES_DATA_PER_TRACK;
+
+    uint8_t *image = calloc(1, size > 0 ? size : 1);
+    if (!image)
+    {
+        dsk_printf(NULL, "out of memory.\n");
+        return NULL;
+    }
+
+    DSK_Drive *drv = dsk_mount_memory(image, size);
+    free(image);
+
+    if (!drv)
+        return NULL;
+
+    dsk_format(drv);
+
+    return drv;
+}
+
+//------------------------------------
+// write the whole DSK image to filename in a single write
+// a NULL filename saves a file backed drive over its own file
+//------------------------------------
+static int save_locked(DSK_Drive *drv, const char *filename)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        dsk_printf("file '%s' not found.\n", current_file);
+        dsk_printf(drv, "disk invalid.\n");
         return E_FAIL;
     }
 
-    // ensure new file does not already exist
-    DSK_DirEntry *dirent2 = find_file_in_dir(drv, new_file);
-    if (dirent2)
+    if (dsk_flush(drv))
+        return E_FAIL;
+
+    if (!filename)
     {
-        dsk_printf("file '%s' already exists.\n", new_file);
+        // file backed drives are already up to date
+        if (drv->fp)
+            return E_OK;
+
+        dsk_printf(drv, "no filename given.\n");
         return E_FAIL;
     }
 
-    // copy in the new filename, padding with spaces
-    char *pExt = strchr(new_file, '.');
-    if (!pExt)
-        pExt = strchr(new_file, '/');
+    long size = DSK_TOTAL_SIZE;
+    uint8_t *data = drv->image;
 
-    if (!pExt)
+    if (!data)
     {
-        // no extension, just copy in name padded with spaces
-        for (int i = 0; i < DSK_MAX_FILENAME; i++)
+        data = malloc(size);
+        if (!data)
         {
-            if (i < strlen(new_file))
-                dirent1->filename[i] = new_file[i];
-            else
-                dirent1->filename[i] = ' ';
+            dsk_printf(drv, "out of memory.\n");
+            return E_FAIL;
         }
-    }
-    else
-    {
-        for (int i = 0; i < DSK_MAX_FILENAME; i++)
+
+        if (dsk_read_image(drv, 0, data, size))
         {
-            if (&new_file[i] < pExt)
-                dirent1->filename[i] = new_file[i];
-            else
-                dirent1->filename[i] = ' ';
+            dsk_printf(drv, "error reading disk.\n");
+            free(data);
+            return E_FAIL;
         }
     }
 
-    // copy in the new extension, padding with spaces
+    int result = E_OK;
 
-    // skip the extension marker if present
-    if (pExt)
-        pExt++;
+    // always open in binary mode for consistent behavior
+    FILE *fout = fopen(filename, "wb");
+    if (!fout || fwrite(data, size, 1, fout) != 1)
+    {
+        dsk_printf(drv, "cannot write file '%s'.\n", filename);
+        result = E_FAIL;
+    }
 
-    for (int i = 0; i < DSK_MAX_EXT; i++)
+    if (fout && fclose(fout))
+        result = E_FAIL;
+
+    if (data != drv->image)
+        free(data);
+
+    return result;
+}
+
+//------------------------------------
+// unmount a DSK file, the caller frees drv
+//------------------------------------
+static int unmount_drive_locked(DSK_Drive *drv)
+{
+    if (!drv || drv->drv_status != DSK_MOUNTED)
     {
-        if (pExt && *pExt)
-            dirent1->ext[i] = *pExt++;
-        else
-            dirent1->ext[i] = ' ';
+        dsk_printf(drv, "no disk mounted.\n");
+        return E_FAIL;
     }
 
-    // flush changes to DSK file
-    drv->dirty_flag = 1;
+    // uncommitted changes are discarded
+    if (drv->in_transaction)
+        dsk_rollback(drv);
+
+    // ensure any changes are written!
     dsk_flush(drv);
 
+    free(drv->cache);
+    drv->cache = NULL;
+
+    free_chains(drv);
+
+    // memory drives own their image, read only drives borrow theirs
+    if (!drv->fp && !drv->read_only)
+        free(drv->image);
+#ifdef DSK_HAVE_MMAP
+    else if (drv->fp && drv->image)
+        munmap(drv->image, drv->image_size);
+#endif
+    drv->image = NULL;
+
+    // fflush(drv->fp);
+    if (drv->fp)
+        fclose(drv->fp);
+    
+    drv->fp = NULL;
+    drv->drv_status = DSK_UNMOUNTED;
+
     return E_OK;
 }
+
+//------------------------------------
+// find and return a free dir entry
+//------------------------------------
+static DSK_DirEntry *find_free_dir_entry(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid\n");
+        return NULL;
+    }
+
+    // find dir entry
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        DSK_DirEntry *dirent = &drv->dirs[i];
+
+        if (!dir_entry_in_use(dirent))
+            return dirent;
+    }
+
+    return NULL;
+}
+
+//------------------------------------
+// uppercase the string
+//------------------------------------
+static char *string_upper(char *s)
+{
+    char *pstr = s;
+
+    for (; *s; s++)
+    {
+        *s = toupper(*s);
+    }
+
+    return pstr;
+}
+
+//------------------------------------
+// return the first free granule at or after start, wrapping around
+//------------------------------------
+static int find_free_granule(DSK_Drive *drv, int start)
+{
+    if (start < 0 || start >= DSK_TOTAL_GRANULES)
+        start = 0;
+
+    int gran = next_free_granule(drv, start);
+    if (gran < 0)
+        gran = next_free_granule(drv, 0);
+
+    DSK_TRACE("returning free granule: %d\n", gran);
+    return gran;
+}
+
+//------------------------------------
+// a run of free granules
+//------------------------------------
+typedef struct
+{
+    int start;
+    int length;
+} FreeRun;
+
+//------------------------------------
+// order free runs longest first
+//------------------------------------
+static int compare_runs(const void *a, const void *b)
+{
+    return ((const FreeRun *)b)->length - ((const FreeRun *)a)->length;
+}
+
+//------------------------------------
+// order granules by number
+//------------------------------------
+static int compare_granules(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+//------------------------------------
+// return first granule of a free run that holds count granules,
+// chosen by the drive's allocation policy, or -1 if none
+//------------------------------------
+static int pick_run(DSK_Drive *drv, FreeRun *runs, int run_count, int count)
+{
+    int best = -1;
+
+    if (!run_count)
+        return -1;
+
+    if (drv->alloc_policy == DSK_ALLOC_NEXT_FIT)
+    {
+        int cursor = drv->next_fit_granule;
+
+        // start with the run holding or following the cursor, wrapping around
+        int first = 0;
+        while (first < run_count && runs[first].start + runs[first].length <= cursor)
+            first++;
+
+        for (int n = 0; n <= run_count; n++)
+        {
+            FreeRun *run = &runs[(first + n) % run_count];
+            int start = run->start;
+
+            // the first run may be entered part way through
+            if (n == 0 && cursor > start && cursor < start + run->length)
+                start = cursor;
+
+            if (run->start + run->length - start >= count)
+                return start;
+        }
+
+        return -1;
+    }
+
+    for (int i = 0; i < run_count; i++)
+    {
+        if (runs[i].length < count)
+            continue;
+
+        // first fit takes the first, best fit the smallest
+        if (drv->alloc_policy != DSK_ALLOC_BEST_FIT)
+            return runs[i].start;
+
+        if (best < 0 || runs[i].length < runs[best].length)
+            best = i;
+    }
+
+    return best < 0 ? -1 : runs[best].start;
+}
+
+//------------------------------------
+// allocate and reserve count granules for a file into plan, as a single
+// contiguous run chosen by the drive's policy when one exists, otherwise
+// from the fewest (longest) runs in physical order
+//------------------------------------
+static int alloc_granules(DSK_Drive *drv, int count, int *plan)
+{
+    FreeRun runs[DSK_MAX_GRANULES / 2 + 1];
+    int run_count = 0;
+
+    if (count <= 0)
+        return E_OK;
+
+    if (count > drv->free_granules)
+        return E_FAIL;
+
+    // find every run of free granules from the free map
+    for (int gran = next_free_granule(drv, 0); gran >= 0; )
+    {
+        int end = gran;
+
+        while (end < DSK_TOTAL_GRANULES && granule_is_free(drv, end))
+            end++;
+
+        runs[run_count].start = gran;
+        runs[run_count].length = end - gran;
+        run_count++;
+
+        gran = end < DSK_TOTAL_GRANULES ? next_free_granule(drv, end) : -1;
+    }
+
+    // pick a run that holds the whole file
+    int start = pick_run(drv, runs, run_count, count);
+
+    if (start >= 0)
+    {
+        for (int i = 0; i < count; i++)
+            plan[i] = start + i;
+    }
+    else
+    {
+        // no single run is big enough, use the longest ones
+        int n = 0;
+
+        qsort(runs, run_count, sizeof(FreeRun), compare_runs);
+        for (int i = 0; n < count; i++)
+            for (int j = 0; j < runs[i].length && n < count; j++)
+                plan[n++] = runs[i].start + j;
+
+        qsort(plan, count, sizeof(int), compare_granules);
+    }
+
+    // reserve the granules
+    for (int i = 0; i < count; i++)
+        set_granule(drv, plan[i], 0xC0);
+
+    drv->next_fit_granule = (plan[count - 1] + 1) % DSK_TOTAL_GRANULES;
+
+    DSK_TRACE("allocated %d granules starting at %d\n", count, plan[0]);
+
+    return E_OK;
+}
+
+//------------------------------------
+// select the granule allocation policy for a drive
+//------------------------------------
+static int set_alloc_policy_locked(DSK_Drive *drv, DSK_ALLOC_POLICY policy)
+{
+    assert(drv);
+    if (!drv)
+        return E_FAIL;
+
+    if (policy != DSK_ALLOC_FIRST_FIT && policy != DSK_ALLOC_BEST_FIT && policy != DSK_ALLOC_NEXT_FIT)
+    {
+        dsk_printf(drv, "invalid allocation policy.\n");
+        return E_FAIL;
+    }
+
+    drv->alloc_policy = policy;
+
+    return E_OK;
+}
+
+//------------------------------------
+// Convert host line endings to CoCo CR format (for adding files to DSK)
+// Handles CRLF -> CR and LF -> CR. Returns new size (may shrink).
+// pending_cr carries a trailing CR across calls so CRLF pairs split
+// between buffers are handled. dst may equal src.
+//------------------------------------
+static size_t translate_to_coco_scalar(char *dst, const char *src, size_t size, int *pending_cr)
+{
+    size_t j = 0;
+    int last_cr = *pending_cr;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (src[i] == 0x0a)
+        {
+            // CRLF -> CR (skip the LF), standalone LF -> CR
+            if (!last_cr)
+                dst[j++] = 0x0d;
+            last_cr = FALSE;
+        }
+        else
+        {
+            dst[j++] = src[i];
+            last_cr = (src[i] == 0x0d);
+        }
+    }
+
+    *pending_cr = last_cr;
+    return j;
+}
+
+//------------------------------------
+// Convert CoCo CR to host line endings (for extracting files from DSK)
+// On Windows: CR -> CRLF (expands). On Unix: CR -> LF (same size).
+// dst must have room for expansion (up to 2x size on Windows).
+// Returns new size.
+//------------------------------------
+static size_t translate_from_coco_scalar(char *dst, const char *src, size_t size)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (src[i] == 0x0d)
+        {
+#ifdef _WIN32
+            // CR -> CRLF on Windows
+            dst[j++] = 0x0d;
+            dst[j++] = 0x0a;
+#else
+            // CR -> LF on Unix
+            dst[j++] = 0x0a;
+#endif
+        }
+        else
+        {
+            dst[j++] = src[i];
+        }
+    }
+    return j;
+}
+
+#ifdef DSK_HAVE_SSE2
+//------------------------------------
+// SSE2 translate to CoCo. Blocks of 16 bytes without an LF are
+// copied as is, blocks containing one go through the scalar code.
+// Each block is loaded before it is stored and dst never runs
+// ahead of src, so translating in place is safe.
+//------------------------------------
+static size_t translate_to_coco_sse2(char *dst, const char *src, size_t size, int *pending_cr)
+{
+    const __m128i lf = _mm_set1_epi8(0x0a);
+    size_t i = 0, j = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)))
+        {
+            j += translate_to_coco_scalar(dst + j, src + i, 16, pending_cr);
+            continue;
+        }
+
+        *pending_cr = (src[i + 15] == 0x0d);
+        _mm_storeu_si128((__m128i *)(dst + j), v);
+        j += 16;
+    }
+
+    return j + translate_to_coco_scalar(dst + j, src + i, size - i, pending_cr);
+}
+
+//------------------------------------
+// SSE2 translate from CoCo
+//------------------------------------
+static size_t translate_from_coco_sse2(char *dst, const char *src, size_t size)
+{
+    const __m128i cr = _mm_set1_epi8(0x0d);
+    size_t i = 0, j = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i mask = _mm_cmpeq_epi8(v, cr);
+
+#ifdef _WIN32
+        // CR expands to CRLF, let the scalar code handle the block
+        if (_mm_movemask_epi8(mask))
+        {
+            j += translate_from_coco_scalar(dst + j, src + i, 16);
+            continue;
+        }
+#else
+        // CR -> LF, 0x0d ^ 0x07 == 0x0a
+        v = _mm_xor_si128(v, _mm_and_si128(mask, _mm_set1_epi8(0x07)));
+#endif
+        _mm_storeu_si128((__m128i *)(dst + j), v);
+        j += 16;
+    }
+
+    return j + translate_from_coco_scalar(dst + j, src + i, size - i);
+}
+#endif
+
+#ifdef DSK_HAVE_AVX2
+//------------------------------------
+// AVX2 translate to CoCo, as SSE2 with 32 byte blocks
+//------------------------------------
+__attribute__((target("avx2")))
+static size_t translate_to_coco_avx2(char *dst, const char *src, size_t size, int *pending_cr)
+{
+    const __m256i lf = _mm256_set1_epi8(0x0a);
+    size_t i = 0, j = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf)))
+        {
+            j += translate_to_coco_scalar(dst + j, src + i, 32, pending_cr);
+            continue;
+        }
+
+        *pending_cr = (src[i + 31] == 0x0d);
+        _mm256_storeu_si256((__m256i *)(dst + j), v);
+        j += 32;
+    }
+
+    return j + translate_to_coco_sse2(dst + j, src + i, size - i, pending_cr);
+}
+
+//------------------------------------
+// AVX2 translate from CoCo
+//------------------------------------
+__attribute__((target("avx2")))
+static size_t translate_from_coco_avx2(char *dst, const char *src, size_t size)
+{
+    const __m256i cr = _mm256_set1_epi8(0x0d);
+    size_t i = 0, j = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i mask = _mm256_cmpeq_epi8(v, cr);
+
+#ifdef _WIN32
+        if (_mm256_movemask_epi8(mask))
+        {
+            j += translate_from_coco_scalar(dst + j, src + i, 32);
+            continue;
+        }
+#else
+        v = _mm256_xor_si256(v, _mm256_and_si256(mask, _mm256_set1_epi8(0x07)));
+#endif
+        _mm256_storeu_si256((__m256i *)(dst + j), v);
+        j += 32;
+    }
+
+    return j + translate_from_coco_sse2(dst + j, src + i, size - i);
+}
+#endif
+
+//------------------------------------
+// translation kernels, selected once on first use
+//------------------------------------
+typedef size_t (*DSK_ToCocoFn)(char *dst, const char *src, size_t size, int *pending_cr);
+typedef size_t (*DSK_FromCocoFn)(char *dst, const char *src, size_t size);
+
+static DSK_ToCocoFn to_coco_fn;
+static DSK_FromCocoFn from_coco_fn;
+
+static void select_translators(void)
+{
+    DSK_ToCocoFn to_fn = translate_to_coco_scalar;
+    DSK_FromCocoFn from_fn = translate_from_coco_scalar;
+
+#ifdef DSK_HAVE_SSE2
+    to_fn = translate_to_coco_sse2;
+    from_fn = translate_from_coco_sse2;
+#endif
+
+#ifdef DSK_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        to_fn = translate_to_coco_avx2;
+        from_fn = translate_from_coco_avx2;
+    }
+#endif
+
+    to_coco_fn = to_fn;
+    from_coco_fn = from_fn;
+}
+
+//------------------------------------
+// select the translation kernels once, whichever thread gets here first
+//------------------------------------
+#ifdef _WIN32
+static INIT_ONCE translators_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK select_translators_once(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    select_translators();
+    return TRUE;
+}
+
+static void init_translators(void)
+{
+    InitOnceExecuteOnce(&translators_once, select_translators_once, NULL, NULL);
+}
+#else
+static pthread_once_t translators_once = PTHREAD_ONCE_INIT;
+
+static void init_translators(void)
+{
+    pthread_once(&translators_once, select_translators);
+}
+#endif
+
+//------------------------------------
+// Convert host line endings to CoCo CR format, see translate_to_coco_scalar
+//------------------------------------
+static size_t translate_to_coco(char *dst, const char *src, size_t size, int *pending_cr)
+{
+    init_translators();
+
+    return to_coco_fn(dst, src, size, pending_cr);
+}
+
+//------------------------------------
+// Convert CoCo CR to host line endings, see translate_from_coco_scalar
+//------------------------------------
+static size_t translate_from_coco(char *dst, const char *src, size_t size)
+{
+    init_translators();
+
+    return from_coco_fn(dst, src, size);
+}
+
+//------------------------------------
+// data being added to the DSK, from a stream or caller memory
+//------------------------------------
+typedef struct
+{
+    FILE *fp;
+    const char *data;
+    size_t size;
+    size_t pos;
+} DSK_Source;
+
+//------------------------------------
+// read up to size bytes from source
+//------------------------------------
+static size_t source_read(DSK_Source *src, char *dst, size_t size)
+{
+    if (src->fp)
+        return fread(dst, 1, size, src->fp);
+
+    if (size > src->size - src->pos)
+        size = src->size - src->pos;
+
+    memcpy(dst, src->data + src->pos, size);
+    src->pos += size;
+
+    return size;
+}
+
+//------------------------------------
+// return bytes remaining in stream, or -1 if unknown (e.g. a pipe)
+//------------------------------------
+static long stream_remaining(FILE *fin)
+{
+    long pos = ftell(fin);
+    if (pos < 0 || fseek(fin, 0, SEEK_END))
+        return -1;
+
+    long size = ftell(fin);
+    fseek(fin, pos, SEEK_SET);
+
+    return size < pos ? -1 : size - pos;
+}
+
+//------------------------------------
+// fill a granule buffer from stream, translating if ASCII
+// returns number of bytes placed in dst
+//------------------------------------
+static size_t read_granule(DSK_Source *src, char *dst, DSK_OPEN_MODE mode, int *pending_cr)
+{
+    size_t used = 0;
+
+    while (used < DSK_BYTES_PER_GRANULE)
+    {
+        size_t n = source_read(src, dst + used, DSK_BYTES_PER_GRANULE - used);
+        if (!n)
+            break;
+
+        // translated data never grows so it can be done in place
+        if (mode == DSK_MODE_ASCII)
+            n = translate_to_coco(dst + used, dst + used, n, pending_cr);
+
+        used += n;
+    }
+
+    return used;
+}
+
+//------------------------------------
+// return size of source data once stored on the DSK, -1 if unknown
+// ASCII streams are read and translated, then rewound
+//------------------------------------
+static long measure_source(DSK_Source *src, DSK_OPEN_MODE mode)
+{
+    char buf[DSK_BYTES_PER_GRANULE];
+    int pending_cr = FALSE;
+    long size = 0;
+    FILE *fin = src->fp;
+
+    if (!fin)
+    {
+        if (mode == DSK_MODE_BINARY)
+            return src->size - src->pos;
+
+        for (size_t pos = src->pos; pos < src->size; pos += sizeof(buf))
+        {
+            size_t n = src->size - pos < sizeof(buf) ? src->size - pos : sizeof(buf);
+            size += translate_to_coco(buf, src->data + pos, n, &pending_cr);
+        }
+
+        return size;
+    }
+
+    long pos = ftell(fin);
+    if (pos < 0)
+        return -1;
+
+    if (mode == DSK_MODE_BINARY)
+        return stream_remaining(fin);
+
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fin)) > 0)
+        size += translate_to_coco(buf, buf, n, &pending_cr);
+
+    if (ferror(fin) || fseek(fin, pos, SEEK_SET))
+        return -1;
+
+    return size;
+}
+
+//------------------------------------
+// granules needed to store size bytes, full granules are always
+// followed by a (possibly empty) tail granule
+//------------------------------------
+static int granules_for_size(long size)
+{
+    return size / DSK_BYTES_PER_GRANULE + 1;
+}
+
+//------------------------------------
+// count unused directory entries
+//------------------------------------
+static int count_free_dir_entries(DSK_Drive *drv)
+{
+    int count = 0;
+
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        DSK_DirEntry *dirent = &drv->dirs[i];
+
+        if (!dir_entry_in_use(dirent))
+            count++;
+    }
+
+    return count;
+}
+
+//------------------------------------
+// fill in name, ext, type and encoding of a new directory entry
+// normalized "NAME.EXT" is returned in dest_filename
+//------------------------------------
+static int make_dir_entry(DSK_Drive *drv, DSK_DirEntry *entry, char *dest_filename, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    char name[DSK_MAX_FILENAME + DSK_MAX_EXT + 2];
+
+    // check filename.ext length
+    if (strlen(filename) > DSK_MAX_FILENAME + DSK_MAX_EXT + 1)
+    {
+        dsk_printf(drv, "filename '%s' is too long.\n", filename);
+        return E_FAIL;
+    }
+
+    // get dest filename and ensure upper case
+    strcpy(dest_filename, filename);
+    string_upper(dest_filename);
+    strcpy(name, dest_filename);
+
+    memset(entry, 0, sizeof(DSK_DirEntry));
+
+    // split at the first '.', strtok is not thread safe
+    char *basefile = name + strspn(name, ".");
+    char *ext = strchr(basefile, '.');
+    if (ext)
+        *ext++ = 0;
+
+    // copy in the filename, left justified, padded with spaces
+    for (int i = 0; i < DSK_MAX_FILENAME; i++)
+    {
+        if (basefile && i < strlen(basefile))
+            entry->filename[i] = basefile[i];
+        else
+            entry->filename[i] = ' ';
+    }
+
+    // copy in the extension, left justified, padded with spaces
+    for (int i = 0; i < DSK_MAX_EXT; i++)
+    {
+        if (ext && i < strlen(ext))
+            entry->ext[i] = ext[i];
+        else
+            entry->ext[i] = ' ';
+    }
+
+    DSK_TRACE("%s -> file: %s, ext: %s\n", dest_filename, basefile ? basefile : "", ext ? ext : "");
+    
+    entry->binary_ascii = (mode == DSK_MODE_ASCII) ? DSK_ENCODING_ASCII : DSK_ENCODING_BINARY;
+    entry->type = type;
+
+    return E_OK;
+}
+
+//------------------------------------
+// write source data to the DSK, a granule at a time
+// granules are taken from plan first, then allocated as needed
+// on failure the FAT is left modified and the caller must restore it
+//------------------------------------
+static int write_source(DSK_Drive *drv, DSK_Source *src, DSK_OPEN_MODE mode, const int *plan, int plan_count, DSK_DirEntry *entry)
+{
+    char granule_data[DSK_BYTES_PER_GRANULE];
+    int first_gran = -1, prev_gran = -1, gran;
+    int pending_cr = FALSE;
+    int count = 0;
+    size_t used;
+
+    for (;; count++)
+    {
+        // beyond the plan, keep the file as contiguous as we can
+        gran = count < plan_count ? plan[count] : find_free_granule(drv, prev_gran + 1);
+        if (gran < 0)
+        {
+            dsk_printf(drv, "out of space.\n");
+            return E_FAIL;
+        }
+
+        if (prev_gran < 0)
+            first_gran = gran;
+        else
+            set_granule(drv, prev_gran, gran);
+
+        // reserve the granule so the next find skips it
+        set_granule(drv, gran, 0xC0);
+
+        // binary data is read straight into the mapped image if we have one,
+        // ASCII is translated in a scratch buffer so slack bytes are untouched
+        char *dst = (mode == DSK_MODE_BINARY) ? (char *)dsk_granule_ptr(drv, gran) : NULL;
+        if (!dst)
+            dst = granule_data;
+
+        used = read_granule(src, dst, mode, &pending_cr);
+
+        if (src->fp && ferror(src->fp))
+        {
+            dsk_printf(drv, "error reading file.\n");
+            return E_FAIL;
+        }
+
+        // the caller restores the FAT, freeing the granules, on failure
+        if (dst == granule_data && used && dsk_write_image(drv, dsk_granule_offset(drv, gran), granule_data, used))
+        {
+            dsk_printf(drv, "error writing disk.\n");
+            return E_FAIL;
+        }
+
+        if (used < DSK_BYTES_PER_GRANULE)
+            break;
+
+        prev_gran = gran;
+    }
+
+    // release any planned granules the stream did not need
+    for (count++; count < plan_count; count++)
+        set_granule(drv, plan[count], DSK_GRANULE_FREE);
+
+    // find number of sectors used in last granule
+    int tail_sectors = used / DSK_BYTES_DATA_PER_SECTOR;
+    int extra_bytes = used % DSK_BYTES_DATA_PER_SECTOR;
+    DSK_TRACE("tail sectors: %d, extra bytes: %d\n", tail_sectors, extra_bytes);
+
+    // mark last granule
+    set_granule(drv, gran, 0xC0 + tail_sectors + (extra_bytes > 0));
+
+    // update bytes in last sector, respecting endianness
+    entry->bytes_in_last_sector = htons(extra_bytes);
+    entry->first_granule = first_gran;
+
+    return E_OK;
+}
+
+//------------------------------------
+// add file to a mounted DSK file
+//------------------------------------
+static int add_file_locked(DSK_Drive *drv, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    // always open in binary mode for consistent behavior
+    FILE *fin = fopen(filename, "rb");
+    if (!fin)
+    {
+        dsk_printf(drv, "file not found.\n");
+        return E_FAIL;
+    }
+
+    int result = dsk_add_stream(drv, fin, dsk_basename(filename), mode, type);
+
+    fclose(fin);
+
+    return result;
+}
+
+//------------------------------------
+// add the contents of a source to a mounted DSK file
+// the source is read a granule at a time so size need not be known
+//------------------------------------
+static int add_source(DSK_Drive *drv, DSK_Source *src, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    char dest_filename[DSK_MAX_FILENAME + DSK_MAX_EXT + 2];
+    DSK_DirEntry entry;
+
+    if (read_only(drv))
+        return E_FAIL;
+
+    if (make_dir_entry(drv, &entry, dest_filename, filename, mode, type))
+        return E_FAIL;
+
+    DSK_TRACE("adding file '%s'\n", dest_filename);
+
+    // when the stored size can be measured fail early, otherwise (e.g. a
+    // pipe) granules are allocated as data arrives and rolled back on failure
+    long src_size = measure_source(src, mode);
+    int plan_count = src_size >= 0 ? granules_for_size(src_size) : 0;
+    if (plan_count > dsk_free_granules(drv))
+    {
+        dsk_printf(drv, "out of space.\n");
+        return E_FAIL;
+    }
+
+    // see if file already exists on DSK
+    DSK_DirEntry *dirent = find_file_in_dir(drv, dest_filename);
+    if (dirent)
+    {
+        dsk_printf(drv, "file already exists.\n");
+        return E_FAIL;
+    }
+
+    // find first free directory entry
+    dirent = find_free_dir_entry(drv);
+    if (!dirent)
+    {
+        dsk_printf(drv, "drive is full.\n");
+        return E_FAIL;
+    }
+
+    // the directory entry is only stored once all the data is written
+    int plan[DSK_MAX_GRANULES];
+    DSK_FAT saved_fat = drv->fat;
+
+    if (alloc_granules(drv, plan_count, plan) || write_source(drv, src, mode, plan, plan_count, &entry))
+    {
+        drv->fat = saved_fat;
+        build_free_map(drv);
+        return E_FAIL;
+    }
+
+    *dirent = entry;
+    dir_index_add(drv, dirent);
+
+    // update DSK image
+    drv->dirty_flag = 1;
+
+    return dsk_flush(drv);
+}
+
+//------------------------------------
+// add the contents of an open stream to a mounted DSK file
+//------------------------------------
+static int add_stream_locked(DSK_Drive *drv, FILE *fin, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED && fin);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    DSK_Source src = { fin };
+
+    return add_source(drv, &src, filename, mode, type);
+}
+
+//------------------------------------
+// add a file to a mounted DSK file from memory
+//------------------------------------
+static int write_file_from_buffer_locked(DSK_Drive *drv, const char *filename, const void *buf, size_t size, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED && (buf || !size));
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    DSK_Source src = { NULL, (const char *)buf, size, 0 };
+
+    return add_source(drv, &src, filename, mode, type);
+}
+
+//------------------------------------
+// add several files to a mounted DSK file in one operation
+// space and directory slots are checked for the whole batch, granules
+// for every file are planned up front, data is written in physical
+// order and the DSK is flushed once
+//------------------------------------
+static int add_files_locked(DSK_Drive *drv, const char **filenames, int count, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    char dest_filename[DSK_MAX_FILENAME + DSK_MAX_EXT + 2];
+    int result = E_FAIL;
+
+    assert(drv && drv->drv_status == DSK_MOUNTED && filenames);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    // binary data is read straight into the mapping, which may be read only
+    if (read_only(drv))
+        return E_FAIL;
+
+    if (count <= 0)
+        return E_OK;
+
+    if (count > count_free_dir_entries(drv))
+    {
+        dsk_printf(drv, "drive is full.\n");
+        return E_FAIL;
+    }
+
+    DSK_DirEntry *entries = calloc(count, sizeof(DSK_DirEntry));
+    int *grans = calloc(count, sizeof(int));
+    int *starts = calloc(count, sizeof(int));
+    int *order = calloc(count, sizeof(int));
+    int *plan = calloc(DSK_TOTAL_GRANULES, sizeof(int));
+    if (!entries || !grans || !starts || !order || !plan)
+    {
+        dsk_printf(drv, "out of memory.\n");
+        goto done;
+    }
+
+    // validate names and measure every file
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (make_dir_entry(drv, &entries[i], dest_filename, dsk_basename(filenames[i]), mode, type))
+            goto done;
+
+        if (find_file_in_dir(drv, dest_filename))
+        {
+            dsk_printf(drv, "file '%s' already exists.\n", dest_filename);
+            goto done;
+        }
+
+        for (int j = 0; j < i; j++)
+        {
+            if (!memcmp(entries[j].filename, entries[i].filename, DSK_MAX_FILENAME + DSK_MAX_EXT))
+            {
+                dsk_printf(drv, "file '%s' given more than once.\n", dest_filename);
+                goto done;
+            }
+        }
+
+        FILE *fin = fopen(filenames[i], "rb");
+        if (!fin)
+        {
+            dsk_printf(drv, "file '%s' not found.\n", filenames[i]);
+            goto done;
+        }
+
+        DSK_Source src = { fin };
+        long size = measure_source(&src, mode);
+        fclose(fin);
+
+        if (size < 0)
+        {
+            dsk_printf(drv, "error reading file '%s'.\n", filenames[i]);
+            goto done;
+        }
+
+        grans[i] = granules_for_size(size);
+        total += grans[i];
+    }
+
+    if (total > dsk_free_granules(drv))
+    {
+        dsk_printf(drv, "out of space.\n");
+        goto done;
+    }
+
+    // plan and reserve granules for every file in the batch
+    DSK_FAT saved_fat = drv->fat;
+    int next = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (alloc_granules(drv, grans[i], plan + next))
+        {
+            dsk_printf(drv, "out of space.\n");
+            drv->fat = saved_fat;
+            build_free_map(drv);
+            goto done;
+        }
+
+        order[i] = i;
+        starts[i] = next;
+        next += grans[i];
+    }
+
+    // write file data in physical order
+    for (int i = 1; i < count; i++)
+    {
+        for (int j = i; j > 0 && plan[starts[order[j]]] < plan[starts[order[j - 1]]]; j--)
+        {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+
+    for (int k = 0; k < count; k++)
+    {
+        int i = order[k];
+
+        FILE *fin = fopen(filenames[i], "rb");
+        if (!fin)
+        {
+            dsk_printf(drv, "file '%s' not found.\n", filenames[i]);
+            drv->fat = saved_fat;
+            build_free_map(drv);
+            goto done;
+        }
+
+        DSK_Source src = { fin };
+        int failed = write_source(drv, &src, mode, plan + starts[i], grans[i], &entries[i]);
+        fclose(fin);
+
+        if (failed)
+        {
+            drv->fat = saved_fat;
+            build_free_map(drv);
+            goto done;
+        }
+    }
+
+    // store directory entries
+    for (int i = 0; i < count; i++)
+    {
+        DSK_DirEntry *dirent = find_free_dir_entry(drv);
+
+        *dirent = entries[i];
+        dir_index_add(drv, dirent);
+    }
+
+    // update DSK image once
+    drv->dirty_flag = 1;
+    result = dsk_flush(drv);
+
+done:
+    free(entries);
+    free(grans);
+    free(starts);
+    free(order);
+    free(plan);
+
+    return result;
+}
+
+//------------------------------------
+// host file written by file_sink
+//------------------------------------
+typedef struct
+{
+    DSK_Drive *drv;
+    FILE *fp;
+} FileSink;
+
+//------------------------------------
+// sink that writes to a host file
+//------------------------------------
+static int file_sink(void *ctx, const void *data, size_t size)
+{
+    FileSink *out = ctx;
+
+    if (size && fwrite(data, size, 1, out->fp) != 1)
+    {
+        dsk_printf(out->drv, "error writing file.\n");
+        return E_FAIL;
+    }
+
+    return E_OK;
+}
+
+//------------------------------------
+// caller buffer filled by buffer_sink
+//------------------------------------
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t used;        // total bytes produced, may exceed size
+} DSK_BufferSink;
+
+//------------------------------------
+// sink that copies into a caller buffer, counting any overflow
+//------------------------------------
+static int buffer_sink(void *ctx, const void *data, size_t size)
+{
+    DSK_BufferSink *out = ctx;
+
+    if (out->used < out->size)
+    {
+        size_t n = out->size - out->used < size ? out->size - out->used : size;
+        memcpy(out->buf + out->used, data, n);
+    }
+
+    out->used += size;
+
+    return E_OK;
+}
+
+//------------------------------------
+// pass data to the sink, translating if ASCII
+//------------------------------------
+static int write_data(DSK_Sink sink, void *ctx, const char *src, size_t size, int is_ascii)
+{
+    // on Windows, CR->CRLF can double the size
+    char output_data[DSK_BYTES_PER_GRANULE * 2];
+
+    if (!is_ascii)
+        return sink(ctx, src, size);
+
+    while (size)
+    {
+        size_t count = size < DSK_BYTES_PER_GRANULE ? size : DSK_BYTES_PER_GRANULE;
+        size_t out_size = translate_from_coco(output_data, src, count);
+        if (sink(ctx, output_data, out_size))
+            return E_FAIL;
+
+        src += count;
+        size -= count;
+    }
+
+    return E_OK;
+}
+
+//------------------------------------
+// pass size bytes of a granule to the sink
+//------------------------------------
+static int extract_granule(DSK_Drive *drv, int gran, size_t size, int is_ascii, DSK_Sink sink, void *ctx)
+{
+    char granule_data[DSK_BYTES_PER_GRANULE];
+
+    assert(size <= DSK_BYTES_PER_GRANULE);
+
+    // use the mapped image directly if we have one
+    const char *src = (const char *)dsk_granule_ptr(drv, gran);
+    if (!src)
+    {
+        if (dsk_read_image(drv, dsk_granule_offset(drv, gran), granule_data, size))
+            return E_FAIL;
+        src = granule_data;
+    }
+
+    return write_data(sink, ctx, src, size, is_ascii);
+}
+
+//------------------------------------
+// pass the contents of a file to the sink a granule at a time
+//------------------------------------
+static int extract_entry(DSK_Drive *drv, DSK_DirEntry *dirent, DSK_Sink sink, void *ctx)
+{
+    int is_ascii = (dirent->binary_ascii == DSK_ENCODING_ASCII);
+
+    DSK_Chain *chain = get_chain(drv, dirent);
+    if (!chain)
+        return E_FAIL;
+
+    // write out full granules, then the partial last granule
+    long remaining = chain_file_size(chain, dirent);
+    if (remaining < 0)
+    {
+        dsk_printf(drv, "file size invalid.\n");
+        return E_FAIL;
+    }
+
+    for (int i = 0; i < chain->count; i++)
+    {
+        long size = remaining < DSK_BYTES_PER_GRANULE ? remaining : DSK_BYTES_PER_GRANULE;
+
+        DSK_TRACE("extracting granule %2X\n", chain->granules[i]);
+        if (extract_granule(drv, chain->granules[i], size, is_ascii, sink, ctx))
+            return E_FAIL;
+
+        remaining -= size;
+    }
+
+    return E_OK;
+}
+
+//------------------------------------
+// extract a file from the DSK
+//------------------------------------
+static int extract_file_locked(DSK_Drive *drv, const char *filename)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    DSK_DirEntry *dirent = find_file_in_dir(drv, filename);
+    if (!dirent)
+    {
+        dsk_printf(drv, "file not found.\n");
+        return E_FAIL;
+    }
+
+    // always open in binary mode for consistent behavior
+    FILE *fout = fopen(filename, "wb");
+    if (!fout)
+    {
+        dsk_printf(drv, "cannot create file.\n");
+        return E_FAIL;
+    }
+
+    FileSink out = { drv, fout };
+    int result = extract_entry(drv, dirent, file_sink, &out);
+
+    fclose(fout);
+
+    return result;
+}
+
+//------------------------------------
+// extract a file from the DSK to a caller supplied sink
+// the sink may return E_FAIL to stop the extraction
+//------------------------------------
+static int extract_to_sink_locked(DSK_Drive *drv, const char *filename, DSK_Sink sink, void *ctx)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED && sink);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    DSK_DirEntry *dirent = find_file_in_dir(drv, filename);
+    if (!dirent)
+    {
+        dsk_printf(drv, "file not found.\n");
+        return E_FAIL;
+    }
+
+    return extract_entry(drv, dirent, sink, ctx);
+}
+
+//------------------------------------
+// extract a file from the DSK into buf, storing at most size bytes
+// returns the full extracted size, which may be larger than size
+//------------------------------------
+static long read_file_to_buffer_locked(DSK_Drive *drv, const char *filename, void *buf, size_t size)
+{
+    DSK_BufferSink out = { buf, size, 0 };
+
+    assert(buf || !size);
+
+    if (dsk_extract_to_sink(drv, filename, buffer_sink, &out))
+        return E_FAIL;
+
+    return (long)out.used;
+}
+
+//------------------------------------
+// one granule of work for dsk_extract_all
+//------------------------------------
+typedef struct
+{
+    uint8_t granule;
+    uint8_t file;
+    uint8_t index;      // position in the file's granule chain
+} ExtractWork;
+
+//------------------------------------
+// order work by granule
+//------------------------------------
+static int compare_work(const void *a, const void *b)
+{
+    return ((const ExtractWork *)a)->granule - ((const ExtractWork *)b)->granule;
+}
+
+//------------------------------------
+// extract every file matching pattern (NULL for all) in one pass
+// granules are read in physical order so the DSK is read front to back
+// once, files are written as soon as all their granules have been read
+// returns the number of files extracted or E_FAIL
+//------------------------------------
+static int extract_all_locked(DSK_Drive *drv, const char *pattern)
+{
+    DSK_DirEntry *files[DSK_MAX_DIR_ENTRIES];
+    char *data[DSK_MAX_DIR_ENTRIES];
+    int sizes[DSK_MAX_DIR_ENTRIES];
+    int pending[DSK_MAX_DIR_ENTRIES];
+    int file_count = 0, work_count = 0, extracted = 0;
+    int result = E_FAIL;
+
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    ExtractWork *work = malloc(DSK_TOTAL_GRANULES * sizeof(ExtractWork));
+    if (!work)
+    {
+        dsk_printf(drv, "out of memory.\n");
+        return E_FAIL;
+    }
+
+    // gather the granules of every matching file
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        DSK_DirEntry *dirent = &drv->dirs[i];
+
+        if (!dir_entry_in_use(dirent))
+            continue;
+
+        if (pattern && !match_pattern(pattern, drv->dir_names[i]))
+            continue;
+
+        DSK_Chain *chain = get_chain(drv, dirent);
+        if (!chain || work_count + chain->count > DSK_TOTAL_GRANULES)
+        {
+            dsk_printf(drv, "granule chain invalid.\n");
+            goto done;
+        }
+
+        long size = chain_file_size(chain, dirent);
+        if (size < 0)
+        {
+            dsk_printf(drv, "file size invalid.\n");
+            goto done;
+        }
+
+        for (int index = 0; index < chain->count; index++)
+        {
+            work[work_count].granule = chain->granules[index];
+            work[work_count].file = file_count;
+            work[work_count].index = index;
+            work_count++;
+        }
+
+        files[file_count] = dirent;
+        sizes[file_count] = size;
+        pending[file_count] = chain->count;
+        data[file_count] = NULL;
+        file_count++;
+    }
+
+    qsort(work, work_count, sizeof(ExtractWork), compare_work);
+
+    for (int i = 0; i < work_count; i++)
+    {
+        int f = work[i].file;
+        long pos = (long)work[i].index * DSK_BYTES_PER_GRANULE;
+        size_t size = DSK_BYTES_PER_GRANULE;
+
+        if (pos + (long)size > sizes[f])
+            size = sizes[f] - pos;
+
+        if (!data[f])
+        {
+            data[f] = malloc(sizes[f] ? sizes[f] : 1);
+            if (!data[f])
+            {
+                dsk_printf(drv, "out of memory.\n");
+                goto done;
+            }
+        }
+
+        if (dsk_read_image(drv, dsk_granule_offset(drv, work[i].granule), data[f] + pos, size))
+        {
+            dsk_printf(drv, "error reading disk.\n");
+            goto done;
+        }
+
+        // write the file once all of its granules are in
+        if (--pending[f] == 0)
+        {
+            const char *name = drv->dir_names[files[f] - drv->dirs];
+
+            // always open in binary mode for consistent behavior
+            FILE *fout = fopen(name, "wb");
+            if (!fout)
+            {
+                dsk_printf(drv, "cannot create file '%s'.\n", name);
+                goto done;
+            }
+
+            FileSink out = { drv, fout };
+            int failed = write_data(file_sink, &out, data[f], sizes[f], files[f]->binary_ascii == DSK_ENCODING_ASCII);
+            fclose(fout);
+
+            if (failed)
+                goto done;
+
+            free(data[f]);
+            data[f] = NULL;
+            extracted++;
+        }
+    }
+
+    result = extracted;
+
+done:
+    for (int i = 0; i < file_count; i++)
+        free(data[i]);
+
+    free(work);
+
+    return result;
+}
+
+//------------------------------------
+// move the file cursor to position index in the granule chain
+// if extend is set granules are added to the end of the chain
+//------------------------------------
+static int file_seek_granule(DSK_File *file, int index, int extend)
+{
+    DSK_Drive *drv = file->drv;
+
+    // existing granules come straight from the chain index
+    if (!extend)
+    {
+        DSK_Chain *chain = get_chain(drv, file->dirent);
+        if (!chain || index >= chain->count)
+            return E_FAIL;
+
+        file->granule = chain->granules[index];
+        file->chain_index = index;
+
+        return E_OK;
+    }
+
+    // the cursor only moves forward, so restart for earlier granules
+    if (file->granule < 0 || index < file->chain_index)
+    {
+        file->chain_index = 0;
+        file->granule = file->dirent->first_granule;
+    }
+
+    while (file->chain_index < index)
+    {
+        int next_gran = drv->fat.granule_map[file->granule];
+
+        if (DSK_IS_LAST_GRANULE(next_gran))
+        {
+            next_gran = find_free_granule(drv, file->granule + 1);
+            if (next_gran < 0)
+            {
+                dsk_printf(drv, "out of space.\n");
+                return E_FAIL;
+            }
+
+            set_granule(drv, file->granule, next_gran);
+            set_granule(drv, next_gran, 0xC0);
+            drv->dirty_flag = 1;
+        }
+        else if (next_gran >= DSK_TOTAL_GRANULES)
+        {
+            dsk_printf(drv, "granule chain invalid.\n");
+            return E_FAIL;
+        }
+
+        file->granule = next_gran;
+        file->chain_index++;
+    }
+
+    return E_OK;
+}
+
+//------------------------------------
+// write the handle's granule buffer back to the DSK
+//------------------------------------
+static int file_flush_buffer(DSK_File *file)
+{
+    if (!file->buf_dirty)
+        return E_OK;
+
+    if (dsk_write_image(file->drv, dsk_granule_offset(file->drv, file->buf_granule), file->buf, DSK_BYTES_PER_GRANULE))
+        return E_FAIL;
+
+    file->buf_dirty = FALSE;
+
+    return E_OK;
+}
+
+//------------------------------------
+// load granule at chain position index into the handle's buffer
+//------------------------------------
+static int file_load_buffer(DSK_File *file, int index, int extend)
+{
+    if (file->buf_index == index)
+        return E_OK;
+
+    if (file_flush_buffer(file) || file_seek_granule(file, index, extend))
+        return E_FAIL;
+
+    if (dsk_read_image(file->drv, dsk_granule_offset(file->drv, file->granule), file->buf, DSK_BYTES_PER_GRANULE))
+        return E_FAIL;
+
+    file->buf_index = index;
+    file->buf_granule = file->granule;
+
+    return E_OK;
+}
+
+//------------------------------------
+// allocate a handle for dir entry
+//------------------------------------
+static DSK_File *file_new_handle(DSK_Drive *drv, DSK_DirEntry *dirent, int writable)
+{
+    DSK_File *file = malloc(sizeof(DSK_File));
+    if (!file)
+    {
+        dsk_printf(drv, "out of memory.\n");
+        return NULL;
+    }
+
+    memset(file, 0, sizeof(DSK_File));
+
+    file->drv = drv;
+    file->dirent = dirent;
+    file->writable = writable;
+    file->granule = -1;
+    file->buf_index = -1;
+
+    return file;
+}
+
+//------------------------------------
+// open a file on the DSK for reading
+//------------------------------------
+static DSK_File *open_locked(DSK_Drive *drv, const char *filename)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED && filename);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return NULL;
+    }
+
+    DSK_DirEntry *dirent = find_file_in_dir(drv, filename);
+    if (!dirent)
+    {
+        dsk_printf(drv, "file '%s' not found.\n", filename);
+        return NULL;
+    }
+
+    long size = file_size(drv, dirent);
+    if (size < 0)
+        return NULL;
+
+    DSK_File *file = file_new_handle(drv, dirent, FALSE);
+    if (file)
+        file->size = size;
+
+    return file;
+}
+
+//------------------------------------
+// create a new, empty file on the DSK for writing
+//------------------------------------
+static DSK_File *create_locked(DSK_Drive *drv, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    char dest_filename[DSK_MAX_FILENAME + DSK_MAX_EXT + 2];
+    DSK_DirEntry entry;
+    int gran;
+
+    assert(drv && drv->drv_status == DSK_MOUNTED && filename);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return NULL;
+    }
+
+    if (read_only(drv))
+        return NULL;
+
+    if (make_dir_entry(drv, &entry, dest_filename, filename, mode, type))
+        return NULL;
+
+    if (find_file_in_dir(drv, dest_filename))
+    {
+        dsk_printf(drv, "file already exists.\n");
+        return NULL;
+    }
+
+    DSK_DirEntry *dirent = find_free_dir_entry(drv);
+    if (!dirent)
+    {
+        dsk_printf(drv, "drive is full.\n");
+        return NULL;
+    }
+
+    // every file owns at least one granule
+    if (alloc_granules(drv, 1, &gran))
+    {
+        dsk_printf(drv, "out of space.\n");
+        return NULL;
+    }
+
+    DSK_File *file = file_new_handle(drv, dirent, TRUE);
+    if (!file)
+    {
+        set_granule(drv, gran, DSK_GRANULE_FREE);
+        return NULL;
+    }
+
+    entry.first_granule = gran;
+    *dirent = entry;
+    dir_index_add(drv, dirent);
+
+    drv->dirty_flag = 1;
+
+    return file;
+}
+
+//------------------------------------
+// read up to size bytes from the current position
+// returns number of bytes read
+//------------------------------------
+static long read_locked(DSK_File *file, void *buf, long size)
+{
+    char *p = buf;
+    long count = 0;
+
+    assert(file && buf);
+    if (!file || size < 0)
+        return E_FAIL;
+
+    while (count < size && file->pos < file->size)
+    {
+        int index = file->pos / DSK_BYTES_PER_GRANULE;
+        long offset = file->pos % DSK_BYTES_PER_GRANULE;
+        long n = DSK_BYTES_PER_GRANULE - offset;
+
+        if (n > size - count)
+            n = size - count;
+
+        if (n > file->size - file->pos)
+            n = file->size - file->pos;
+
+        if (file_load_buffer(file, index, FALSE))
+            return count ? count : E_FAIL;
+
+        memcpy(p + count, file->buf + offset, n);
+
+        file->pos += n;
+        count += n;
+    }
+
+    return count;
+}
+
+//------------------------------------
+// read up to size bytes at offset straight from the granule chain
+// the handle is not changed, so threads may pread the same handle
+// returns number of bytes read
+//------------------------------------
+static long pread_locked(DSK_File *file, void *buf, long size, long offset)
+{
+    char *p = buf;
+    long count = 0;
+
+    assert(file && buf);
+    if (!file || size < 0 || offset < 0 || offset > file->size)
+        return E_FAIL;
+
+    DSK_Drive *drv = file->drv;
+    DSK_Chain *chain = get_chain(drv, file->dirent);
+    if (!chain)
+        return E_FAIL;
+
+    while (count < size && offset < file->size)
+    {
+        int index = offset / DSK_BYTES_PER_GRANULE;
+        long gran_offset = offset % DSK_BYTES_PER_GRANULE;
+        long n = DSK_BYTES_PER_GRANULE - gran_offset;
+
+        if (n > size - count)
+            n = size - count;
+
+        if (n > file->size - offset)
+            n = file->size - offset;
+
+        if (index >= chain->count)
+        {
+            dsk_printf(drv, "granule chain invalid.\n");
+            return count ? count : E_FAIL;
+        }
+
+        // data written to a created file may only be in its buffer, its
+        // writers hold the drive exclusively so the buffer is stable here
+        if (file->writable && file->buf_dirty && index == file->buf_index)
+            memcpy(p + count, file->buf + gran_offset, n);
+        else if (dsk_read_image(drv, dsk_granule_offset(drv, chain->granules[index]) + gran_offset, p + count, n))
+            return count ? count : E_FAIL;
+
+        offset += n;
+        count += n;
+    }
+
+    return count;
+}
+
+//------------------------------------
+// write size bytes at the current position, extending the file
+// returns number of bytes written
+//------------------------------------
+static long write_locked(DSK_File *file, const void *buf, long size)
+{
+    const char *p = buf;
+    long count = 0;
+
+    assert(file && buf);
+    if (!file || size < 0)
+        return E_FAIL;
+
+    if (!file->writable)
+    {
+        dsk_printf(file->drv, "file not open for writing.\n");
+        return E_FAIL;
+    }
+
+    while (count < size)
+    {
+        int index = file->pos / DSK_BYTES_PER_GRANULE;
+        long offset = file->pos % DSK_BYTES_PER_GRANULE;
+        long n = DSK_BYTES_PER_GRANULE - offset;
+
+        if (n > size - count)
+            n = size - count;
+
+        if (file_load_buffer(file, index, TRUE))
+            return count ? count : E_FAIL;
+
+        memcpy(file->buf + offset, p + count, n);
+        file->buf_dirty = TRUE;
+
+        file->pos += n;
+        count += n;
+
+        if (file->pos > file->size)
+            file->size = file->pos;
+    }
+
+    return count;
+}
+
+//------------------------------------
+// set the current position, whence is SEEK_SET, SEEK_CUR or SEEK_END
+//------------------------------------
+int dsk_seek(DSK_File *file, long offset, int whence)
+{
+    assert(file);
+    if (!file)
+        return E_FAIL;
+
+    if (whence == SEEK_CUR)
+        offset += file->pos;
+    else if (whence == SEEK_END)
+        offset += file->size;
+
+    if (offset < 0 || offset > file->size)
+        return E_FAIL;
+
+    file->pos = offset;
+
+    return E_OK;
+}
+
+//------------------------------------
+// return the current position
+//------------------------------------
+long dsk_tell(DSK_File *file)
+{
+    assert(file);
+    if (!file)
+        return E_FAIL;
+
+    return file->pos;
+}
+
+//------------------------------------
+// close a file, completing the FAT and dir entry of created files
+//------------------------------------
+static int close_locked(DSK_File *file)
+{
+    int result = E_OK;
+
+    assert(file);
+    if (!file)
+        return E_FAIL;
+
+    if (file->writable)
+    {
+        DSK_Drive *drv = file->drv;
+        int index = file->size / DSK_BYTES_PER_GRANULE;
+        long used = file->size % DSK_BYTES_PER_GRANULE;
+
+        if (file_flush_buffer(file))
+            result = E_FAIL;
+
+        // full granules are followed by a tail granule, if there is no room
+        // for an empty one the last full granule becomes the tail
+        if (file_seek_granule(file, index, TRUE))
+        {
+            index--;
+            used = DSK_BYTES_PER_GRANULE;
+            file_seek_granule(file, index, FALSE);
+        }
+
+        int tail_sectors = used / DSK_BYTES_DATA_PER_SECTOR;
+        int extra_bytes = used % DSK_BYTES_DATA_PER_SECTOR;
+
+        set_granule(drv, file->granule, 0xC0 + tail_sectors + (extra_bytes > 0));
+        file->dirent->bytes_in_last_sector = htons(extra_bytes);
+
+        drv->dirty_flag = 1;
+        if (dsk_flush(drv))
+            result = E_FAIL;
+    }
+
+    free(file);
+
+    return result;
+}
+
+//------------------------------------
+// delete file from mounted DSK
+//------------------------------------
+static int del_locked(DSK_Drive *drv, const char *filename)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    if (read_only(drv))
+        return E_FAIL;
+
+    DSK_DirEntry *dirent = find_file_in_dir(drv, filename);
+    if (!dirent)
+    {
+        dsk_printf(drv, "file '%s' not found.\n", filename);
+        return E_FAIL;
+    }
+
+    // mark all file granules as free, stopping at any damage
+    // freed granules end the walk so a cycle cannot loop forever
+    int gran = dirent->first_granule;
+    while (gran < DSK_TOTAL_GRANULES && drv->fat.granule_map[gran] != DSK_GRANULE_FREE)
+    {
+        int next_gran = drv->fat.granule_map[gran];
+        DSK_TRACE("marking granule %2X as free.\n", gran);
+        set_granule(drv, gran, DSK_GRANULE_FREE);
+        gran = next_gran;
+    }
+
+    // mark the dir entry as freed
+    dir_index_remove(drv, dirent);
+    dirent->filename[0] = DSK_DIRENT_DELETED;
+
+    drv->dirty_flag = 1;
+
+    dsk_flush(drv);
+
+    return E_OK;
+}
+
+//------------------------------------
+// put back the data of the first count granules a defrag wrote and the
+// FAT and directory the DSK had before it, from the metadata shadow
+//------------------------------------
+static int defrag_restore(DSK_Drive *drv, const uint8_t *source, const uint8_t *seen, const char *staging, int count)
+{
+    int result = E_OK;
+
+    // granules that were free before hold nothing to put back
+    for (int i = 0; i < count; i++)
+    {
+        if (source[i] != i && seen[i] && dsk_write_image(drv, dsk_granule_offset(drv, i), staging + (size_t)i * DSK_BYTES_PER_GRANULE, DSK_BYTES_PER_GRANULE))
+            result = E_FAIL;
+    }
+
+    for (int i = 0; i < DSK_METADATA_SECTORS; i++)
+        memcpy((uint8_t *)metadata_sector(drv, i), drv->meta_shadow[i], DSK_BYTES_DATA_PER_SECTOR);
+
+    build_free_map(drv);
+    build_dir_index(drv);
+
+    // a failed flush may have written some of the new metadata
+    if (metadata_io(drv, 0, DSK_METADATA_SECTORS, TRUE))
+        result = E_FAIL;
+
+    drv->dirty_flag = 0;
+    if (dsk_flush(drv))
+        result = E_FAIL;
+
+    dsk_printf(drv, result ? "defrag failed, DSK may be damaged.\n" : "defrag failed, DSK restored.\n");
+
+    return result;
+}
+
+//------------------------------------
+// rewrite the DSK so every file is contiguous, in directory order,
+// from granule 0, leaving all free space in one run at the end.
+// Used granules are staged in memory, then written to their new
+// places in physical order. A DSK that fails the check is refused, as
+// only granules reached from the directory are kept. On a failed write
+// the old data, FAT and directory are put back. Returns the number of
+// granules moved or E_FAIL.
+//------------------------------------
+static int defrag_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    if (read_only(drv))
+        return E_FAIL;
+
+    // moved data could not be put back by a rollback
+    if (drv->in_transaction)
+    {
+        dsk_printf(drv, "cannot defrag during a transaction.\n");
+        return E_FAIL;
+    }
+
+    // orphaned granules would be freed, other damage could lose data
+    if (check_locked(drv, FALSE))
+    {
+        dsk_printf(drv, "cannot defrag a damaged disk, repair it first.\n");
+        return E_FAIL;
+    }
+
+    // the metadata shadow must hold the FAT and directory to put back
+    if (dsk_flush(drv))
+        return E_FAIL;
+
+    uint8_t counts[DSK_MAX_DIR_ENTRIES], tails[DSK_MAX_DIR_ENTRIES];
+    uint8_t *source = calloc(DSK_TOTAL_GRANULES, 1);
+    uint8_t *seen = calloc(DSK_TOTAL_GRANULES, 1);
+    char *staging = malloc((size_t)DSK_TOTAL_GRANULES * DSK_BYTES_PER_GRANULE);
+    int used = 0, moved = 0, result = E_FAIL;
+
+    if (!source || !seen || !staging)
+    {
+        dsk_printf(drv, "out of memory.\n");
+        goto done;
+    }
+
+    // plan the new layout, new granule i takes the data of source[i]
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        DSK_DirEntry *dirent = &drv->dirs[i];
+
+        if (!dir_entry_in_use(dirent))
+            continue;
+
+        DSK_Chain *chain = get_chain(drv, dirent);
+        if (!chain || !chain->count)
+        {
+            dsk_printf(drv, "granule chain invalid.\n");
+            goto done;
+        }
+
+        counts[i] = chain->count;
+        tails[i] = drv->fat.granule_map[chain->granules[chain->count - 1]];
+
+        for (int j = 0; j < chain->count; j++)
+        {
+            int gran = chain->granules[j];
+
+            // cross-linked granules cannot be given to two files
+            if (seen[gran])
+            {
+                dsk_printf(drv, "granule chain invalid.\n");
+                goto done;
+            }
+
+            seen[gran] = TRUE;
+            source[used++] = gran;
+        }
+    }
+
+    // stage every granule that moves, reading in physical order
+    for (int gran = 0; gran < DSK_TOTAL_GRANULES; gran++)
+    {
+        if (!seen[gran])
+            continue;
+
+        if (dsk_read_image(drv, dsk_granule_offset(drv, gran), staging + (size_t)gran * DSK_BYTES_PER_GRANULE, DSK_BYTES_PER_GRANULE))
+        {
+            dsk_printf(drv, "error reading disk.\n");
+            goto done;
+        }
+    }
+
+    for (int i = 0; i < used; i++)
+    {
+        if (source[i] == i)
+            continue;
+
+        if (dsk_write_image(drv, dsk_granule_offset(drv, i), staging + (size_t)source[i] * DSK_BYTES_PER_GRANULE, DSK_BYTES_PER_GRANULE))
+        {
+            dsk_printf(drv, "error writing disk.\n");
+            defrag_restore(drv, source, seen, staging, i + 1);
+            goto done;
+        }
+
+        moved++;
+    }
+
+    // rebuild the FAT to match, tails keep their sector counts
+    int next = 0;
+
+    memset(drv->fat.granule_map, DSK_GRANULE_FREE, DSK_TOTAL_GRANULES);
+
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        DSK_DirEntry *dirent = &drv->dirs[i];
+
+        if (!dir_entry_in_use(dirent))
+            continue;
+
+        dirent->first_granule = next;
+        for (int j = 0; j < counts[i] - 1; j++, next++)
+            drv->fat.granule_map[next] = next + 1;
+
+        drv->fat.granule_map[next++] = tails[i];
+    }
+
+    build_free_map(drv);
+    drv->next_fit_granule = used % DSK_TOTAL_GRANULES;
+
+    drv->dirty_flag = 1;
+    if (dsk_flush(drv) == E_OK)
+        result = moved;
+    else
+        defrag_restore(drv, source, seen, staging, used);
+
+done:
+    free(source);
+    free(seen);
+    free(staging);
+
+    return result;
+}
+
+//------------------------------------
+// check the FAT and directory for damage: cycles, cross-linked
+// granules, links outside the disk or into free granules, bad tails
+// and orphaned granules, and more tracks than a drive can hold. Every
+// granule is visited at most once so the check is linear. With repair
+// set, bad chains are cut at the last good granule, entries with no
+// good granules are deleted and orphans are freed. Returns the number
+// of problems found or E_FAIL.
+//------------------------------------
+static int check_locked(DSK_Drive *drv, int repair)
+{
+    uint8_t owner[DSK_MAX_GRANULES];    // dir entry + 1 reaching each granule
+    int problems = 0, orphans = 0;
+
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    if (repair && read_only(drv))
+        return E_FAIL;
+
+    memset(owner, 0, sizeof(owner));
+
+    // only granules the FAT and owner map can hold are checked
+    int total = DSK_TOTAL_GRANULES;
+    if (total > DSK_MAX_GRANULES)
+    {
+        dsk_printf(drv, "disk has %d tracks, more than %d.\n", drv->num_tracks, DSK_MAX_TRACKS);
+        problems++;
+        total = DSK_MAX_GRANULES;
+    }
+
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        DSK_DirEntry *dirent = &drv->dirs[i];
+
+        if (!dir_entry_in_use(dirent))
+            continue;
+
+        const char *name = drv->dir_names[i];
+        int gran = dirent->first_granule, prev = -1;
+
+        for (;;)
+        {
+            const char *error = NULL;
+
+            if (gran >= total)
+                error = "links outside the disk";
+            else if (owner[gran] == i + 1)
+                error = "has a cycle";
+            else if (owner[gran])
+                error = "is cross-linked";
+            else if (drv->fat.granule_map[gran] == DSK_GRANULE_FREE)
+                error = "links to a free granule";
+
+            if (error)
+            {
+                dsk_printf(drv, "file '%s' %s at granule %02X.\n", name, error, gran);
+                problems++;
+
+                if (!repair)
+                    break;
+
+                // the last good granule was full, as it linked onward
+                if (prev >= 0)
+                {
+                    set_granule(drv, prev, 0xC0 + DSK_SECTORS_PER_GRANULE);
+                    dirent->bytes_in_last_sector = 0;
+                }
+                else
+                {
+                    dsk_printf(drv, "file '%s' deleted.\n", name);
+                    dir_index_remove(drv, dirent);
+                    dirent->filename[0] = DSK_DIRENT_DELETED;
+                }
+
+                drv->dirty_flag = 1;
+                break;
+            }
+
+            owner[gran] = i + 1;
+
+            int next = drv->fat.granule_map[gran];
+            if (DSK_IS_LAST_GRANULE(next))
+            {
+                int sectors = next & DSK_SECTOR_COUNT_MASK;
+                int bytes = ntohs(dirent->bytes_in_last_sector);
+
+                // a partial last sector must be one of the tail sectors
+                if (bytes > DSK_BYTES_DATA_PER_SECTOR || (bytes && !sectors))
+                {
+                    dsk_printf(drv, "file '%s' has a bad last sector count.\n", name);
+                    problems++;
+
+                    if (repair)
+                    {
+                        dirent->bytes_in_last_sector = 0;
+                        drv->dirty_flag = 1;
+                    }
+                }
+
+                break;
+            }
+
+            prev = gran;
+            gran = next;
+        }
+    }
+
+    // granules in use that no file reaches
+    for (int gran = 0; gran < total; gran++)
+    {
+        if (owner[gran] || drv->fat.granule_map[gran] == DSK_GRANULE_FREE)
+            continue;
+
+        orphans++;
+
+        if (repair)
+        {
+            set_granule(drv, gran, DSK_GRANULE_FREE);
+            drv->dirty_flag = 1;
+        }
+    }
+
+    if (orphans)
+    {
+        dsk_printf(drv, "%d orphaned granules%s.\n", orphans, repair ? " freed" : "");
+        problems += orphans;
+    }
+
+    if (repair && drv->dirty_flag && dsk_flush(drv))
+        return E_FAIL;
+
+    return problems;
+}
+
+//------------------------------------
+// create a new DSK file
+//------------------------------------
+DSK_Drive *dsk_new(char *filename, int tracks, int sides)
+{
+    return dsk_new_ex(filename, tracks, sides, DSK_NEW_DEFAULT);
+}
+
+//------------------------------------
+// create a new DSK file with options
+// the file is sized in one call rather than written a sector at a
+// time, DSK_NEW_SPARSE leaves the data tracks as holes
+//------------------------------------
+DSK_Drive *dsk_new_ex(char *filename, int tracks, int sides, int flags)
+{
+    assert(filename);
+
+    // TODO - check filename and ext length
+
+    // ensure upper case
+    string_upper(filename);
+
+    // a drive holds at most DSK_MAX_TRACKS tracks over all sides
+    if (tracks < 1 || sides < 1 || sides > DSK_MAX_SIDES || tracks * sides < DSK_MIN_TRACKS || tracks * sides > DSK_MAX_TRACKS)
+    {
+        dsk_printf(NULL, "invalid number of tracks or sides.\n");
+        return NULL;
+    }
+
+    FILE *fout = fopen(filename, "wb");
+    if (!fout)
+    {
+        dsk_printf(NULL, "file not found.\n");
+        return NULL;
+    }
+
+    long size = (long)tracks * sides * DSK_BYTES_DATA_PER_TRACK;
+
+#ifdef DSK_HAVE_FTRUNCATE
+    // extending the file fills it with zeros
+    if (ftruncate(fileno(fout), size))
+    {
+        dsk_printf(NULL, "cannot create file.\n");
+        fclose(fout);
+        return NULL;
+    }
+
+#ifdef DSK_HAVE_FALLOCATE
+    // reserve the blocks up front, not all file systems can
+    if (!(flags & DSK_NEW_SPARSE))
+        posix_fallocate(fileno(fout), 0, size);
+#endif
+#else
+    char sector_data[DSK_BYTES_DATA_PER_SECTOR];
+
+    // write out empty DSK
+    memset(sector_data, 0, DSK_BYTES_DATA_PER_SECTOR);
+
+    for (long pos = 0; pos < size; pos += DSK_BYTES_DATA_PER_SECTOR)
+        fwrite(sector_data, sizeof(sector_data), 1, fout);
+#endif
+
+    fclose(fout);
+
+    // mount it
+    DSK_Drive *drv = dsk_mount_drive(filename);
+    if (!drv)
+    {
+        dsk_printf(drv, "disk not found.\n");
+        return NULL;
+    }
+
+    // format it
+    dsk_format(drv);
+
+    return drv;
+}
+
+//------------------------------------
+// copy one DSK file to count new files, e.g. to stamp out blank
+// images from a formatted template. On Linux the copy is done in the
+// kernel with copy_file_range.
+//------------------------------------
+int dsk_copy_image(const char *src_filename, const char **filenames, int count)
+{
+    assert(src_filename && (filenames || !count));
+
+    // always open in binary mode for consistent behavior
+    FILE *fin = fopen(src_filename, "rb");
+    if (!fin)
+    {
+        dsk_printf(NULL, "file '%s' not found.\n", src_filename);
+        return E_FAIL;
+    }
+
+    long size = stream_remaining(fin);
+    char *data = NULL;
+
+#ifndef __linux__
+    data = size > 0 ? malloc(size) : NULL;
+    if (size < 0 || (size && (!data || fread(data, size, 1, fin) != 1)))
+    {
+        dsk_printf(NULL, "error reading file '%s'.\n", src_filename);
+        free(data);
+        fclose(fin);
+        return E_FAIL;
+    }
+#endif
+
+    int result = E_OK;
+
+    for (int i = 0; i < count && result == E_OK; i++)
+    {
+        FILE *fout = fopen(filenames[i], "wb");
+        if (!fout)
+        {
+            dsk_printf(NULL, "cannot create file '%s'.\n", filenames[i]);
+            result = E_FAIL;
+            break;
+        }
+
+#ifdef __linux__
+        // size the copy first, then copy only the data extents of the
+        // source so holes in a sparse template stay holes
+        int in = fileno(fin), out = fileno(fout);
+        loff_t pos = 0;
+
+        if (ftruncate(out, size))
+            result = E_FAIL;
+
+#ifdef DSK_HAVE_FALLOCATE
+        // keep a fully allocated template fully allocated
+        struct stat st;
+        if (result == E_OK && !fstat(in, &st) && (long)st.st_blocks * 512 >= size)
+            posix_fallocate(out, 0, size);
+#endif
+
+        while (result == E_OK && pos < size)
+        {
+            loff_t start = lseek(in, pos, SEEK_DATA);
+            if (start < 0)
+                break;
+
+            loff_t end = lseek(in, start, SEEK_HOLE);
+            if (end < 0 || end > size)
+                end = size;
+
+            loff_t off_in = start, off_out = start;
+            while (off_in < end)
+            {
+                ssize_t n = copy_file_range(in, &off_in, out, &off_out, end - off_in, 0);
+                if (n <= 0)
+                    break;
+            }
+
+            // fall back to a plain copy where the kernel cannot do it
+            if (off_in < end)
+            {
+                if (!data)
+                {
+                    data = malloc(size);
+                    if (!data || pread(in, data, size, 0) != size)
+                    {
+                        result = E_FAIL;
+                        break;
+                    }
+                }
+
+                if (pwrite(out, data + off_in, end - off_in, off_in) != end - off_in)
+                    result = E_FAIL;
+            }
+
+            pos = end;
+        }
+#else
+        if (size && fwrite(data, size, 1, fout) != 1)
+            result = E_FAIL;
+#endif
+
+        if (fclose(fout))
+            result = E_FAIL;
+
+        if (result)
+            dsk_printf(NULL, "cannot write file '%s'.\n", filenames[i]);
+    }
+
+    free(data);
+    fclose(fin);
+
+    return result;
+}
+
+//------------------------------------
+// write the FAT and DIR to the DSK
+//------------------------------------
+static int flush_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    // don't flush if nothing has changed, or until commit
+    if (!drv->dirty_flag || drv->in_transaction)
+    {
+        DSK_TRACE("flush called with no changes.\n");
+    } else
+    {
+        DSK_TRACE("flushing dirty file.\n");
+
+        // find the span of sectors that differ from the DSK
+        int first = -1, last = -1;
+        for (int i = 0; i < DSK_METADATA_SECTORS; i++)
+        {
+            if (memcmp(drv->meta_shadow[i], metadata_sector(drv, i), DSK_BYTES_DATA_PER_SECTOR))
+            {
+                if (first < 0)
+                    first = i;
+                last = i;
+            }
+        }
+
+        // write the FAT and/or Directory sectors in one go
+        if (first >= 0)
+        {
+            DSK_TRACE("writing metadata sectors %d to %d\n", first, last);
+
+            if (metadata_io(drv, first, last - first + 1, TRUE))
+            {
+                dsk_printf(drv, "error writing disk.\n");
+                return E_FAIL;
+            }
+
+            update_metadata_shadow(drv, first, last - first + 1);
+        }
+
+        // clear dirty flag
+        drv->dirty_flag = 0;
+    }
+
+    // write back any cached tracks
+    if (drv->cache)
+        return cache_flush(drv);
+
+    return E_OK;
+}
+
+//------------------------------------
+// start a transaction, FAT and directory changes are kept in memory
+// until dsk_commit writes them once or dsk_rollback discards them
+//------------------------------------
+static int begin_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    if (drv->in_transaction)
+    {
+        dsk_printf(drv, "transaction already active.\n");
+        return E_FAIL;
+    }
+
+    if (read_only(drv))
+        return E_FAIL;
+
+    // once flushed the shadow of the DSK's FAT and directory is the
+    // snapshot to roll back to, nothing else need be kept
+    if (dsk_flush(drv))
+        return E_FAIL;
+
+    drv->in_transaction = TRUE;
+
+    return E_OK;
+}
+
+//------------------------------------
+// end a transaction, writing out the FAT and directory
+//------------------------------------
+static int commit_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    if (!drv->in_transaction)
+    {
+        dsk_printf(drv, "no transaction active.\n");
+        return E_FAIL;
+    }
+
+    drv->in_transaction = FALSE;
+
+    // release granules freed during the transaction
+    build_free_map(drv);
+
+    return dsk_flush(drv);
+}
+
+//------------------------------------
+// end a transaction, restoring the FAT and directory from dsk_begin
+//------------------------------------
+static int rollback_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    if (!drv->in_transaction)
+    {
+        dsk_printf(drv, "no transaction active.\n");
+        return E_FAIL;
+    }
+
+    drv->in_transaction = FALSE;
+
+    // metadata is not written during a transaction, so the shadow
+    // still holds the FAT and directory from dsk_begin
+    for (int i = 0; i < DSK_METADATA_SECTORS; i++)
+        memcpy((uint8_t *)metadata_sector(drv, i), drv->meta_shadow[i], DSK_BYTES_DATA_PER_SECTOR);
+
+    build_free_map(drv);
+    build_dir_index(drv);
+
+    // the DSK still holds the snapshot
+    drv->dirty_flag = 0;
+
+    return E_OK;
+}
+
+//------------------------------------
+// format a mounted drive
+//------------------------------------
+static int format_locked(DSK_Drive *drv)
+{
+    assert(drv && drv->drv_status == DSK_MOUNTED);
+    if (!drv || drv->drv_status != DSK_MOUNTED)
+    {
+        dsk_printf(drv, "disk invalid.\n");
+        return E_FAIL;
+    }
+
+    if (read_only(drv))
+        return E_FAIL;
+
+    // clear FAT granule entries
+    for (int i = 0; i < DSK_TOTAL_GRANULES; i++)
+        drv->fat.granule_map[i] = DSK_GRANULE_FREE;
+
+    // zero other FAT entries
+    for (int i = DSK_TOTAL_GRANULES; i < DSK_BYTES_DATA_PER_SECTOR; i++)
+        drv->fat.granule_map[i] = 0;
+
+    build_free_map(drv);
+
+    // clear Directory entries
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+        drv->dirs[i].filename[0] = DSK_DIRENT_FREE;
+
+    build_dir_index(drv);
+
+    // flush changes to DSK file
+    drv->dirty_flag = 1;
+    dsk_flush(drv);
+
+    return E_OK;
+}
+
+//------------------------------------
+// rename file1 to file2
+//------------------------------------
+static int rename_locked(DSK_Drive *drv, char *current_file, char *new_file)
+{
+    if (read_only(drv))
+        return E_FAIL;
+
+    string_upper(current_file);
+    string_upper(new_file);
+
+    if (strlen(new_file) > DSK_MAX_FILENAME + DSK_MAX_EXT + 1)
+    {
+        dsk_printf(drv, "filename too long.\n");
+        return E_FAIL;
+    }
+
+    // ensure current file exists
+    DSK_DirEntry *dirent1 = find_file_in_dir(drv, current_file);
+    if (!dirent1)
+    {
+        dsk_printf(drv, "file '%s' not found.\n", current_file);
+        return E_FAIL;
+    }
+
+    // ensure new file does not already exist
+    DSK_DirEntry *dirent2 = find_file_in_dir(drv, new_file);
+    if (dirent2)
+    {
+        dsk_printf(drv, "file '%s' already exists.\n", new_file);
+        return E_FAIL;
+    }
+
+    dir_index_remove(drv, dirent1);
+
+    // copy in the new filename, padding with spaces
+    char *pExt = strchr(new_file, '.');
+    if (!pExt)
+        pExt = strchr(new_file, '/');
+
+    if (!pExt)
+    {
+        // no extension, just copy in name padded with spaces
+        for (int i = 0; i < DSK_MAX_FILENAME; i++)
+        {
+            if (i < strlen(new_file))
+                dirent1->filename[i] = new_file[i];
+            else
+                dirent1->filename[i] = ' ';
+        }
+    }
+    else
+    {
+        for (int i = 0; i < DSK_MAX_FILENAME; i++)
+        {
+            if (&new_file[i] < pExt)
+                dirent1->filename[i] = new_file[i];
+            else
+                dirent1->filename[i] = ' ';
+        }
+    }
+
+    // copy in the new extension, padding with spaces
+
+    // skip the extension marker if present
+    if (pExt)
+        pExt++;
+
+    for (int i = 0; i < DSK_MAX_EXT; i++)
+    {
+        if (pExt && *pExt)
+            dirent1->ext[i] = *pExt++;
+        else
+            dirent1->ext[i] = ' ';
+    }
+
+    dir_index_add(drv, dirent1);
+
+    // flush changes to DSK file
+    drv->dirty_flag = 1;
+    dsk_flush(drv);
+
+    return E_OK;
+}
+
+//------------------------------------
+// drive pool
+//
+// A pool keeps recently used images mounted so switching between them
+// does not remount. Drives are keyed by full path and refcounted, and
+// the least recently used unreferenced drive is unmounted (and so
+// flushed) when a new image needs its slot. Images must not be changed
+// by other programs while pooled.
+//------------------------------------
+typedef struct
+{
+    char *path;                     // full path of the image, NULL if unused
+    DSK_Drive *drv;
+    int refs;                       // users holding drv
+    unsigned long last_used;
+} DSK_PoolEntry;
+
+struct DSK_Pool
+{
+    struct DSK_Lock *lock;
+#ifdef _WIN32
+    CONDITION_VARIABLE mounted;
+#else
+    pthread_cond_t mounted;         // signalled when a mount finishes
+#endif
+    int flags;                      // mount flags
+    int size;
+    unsigned long clock;
+    DSK_PoolEntry entries[];
+};
+
+//------------------------------------
+// wait, with the pool locked, for a mount to finish
+//------------------------------------
+static void pool_wait(DSK_Pool *pool)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(&pool->mounted, &pool->lock->state, INFINITE);
+#else
+    pthread_cond_wait(&pool->mounted, &pool->lock->state);
+#endif
+}
+
+//
+static void pool_wake(DSK_Pool *pool)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(&pool->mounted);
+#else
+    pthread_cond_broadcast(&pool->mounted);
+#endif
+}
+
+//------------------------------------
+// create a pool holding up to size mounted images
+//------------------------------------
+DSK_Pool *dsk_pool_new(int size, int flags)
+{
+    if (size < 1)
+        size = 1;
+
+    DSK_Pool *pool = calloc(1, sizeof(DSK_Pool) + size * sizeof(DSK_PoolEntry));
+    if (!pool || !(pool->lock = lock_new()))
+    {
+        dsk_printf(NULL, "out of memory.\n");
+        free(pool);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    InitializeConditionVariable(&pool->mounted);
+#else
+    pthread_cond_init(&pool->mounted, NULL);
+#endif
+
+    pool->size = size;
+    pool->flags = flags;
+
+    return pool;
+}
+
+//------------------------------------
+// return the full path of filename, which the pool is keyed on
+//------------------------------------
+static char *pool_path(const char *filename)
+{
+    char path[FILENAME_MAX];
+
+#ifdef _WIN32
+    if (!_fullpath(path, filename, sizeof(path)))
+#else
+    if (!realpath(filename, path))
+#endif
+        return NULL;
+
+    return strdup(path);
+}
+
+//------------------------------------
+// return the pool entry for path or drv, NULL if not pooled
+//------------------------------------
+static DSK_PoolEntry *pool_find(DSK_Pool *pool, const char *path, DSK_Drive *drv)
+{
+    for (int i = 0; i < pool->size; i++)
+    {
+        DSK_PoolEntry *entry = &pool->entries[i];
+
+        if (entry->path && (path ? !strcmp(entry->path, path) : entry->drv == drv))
+            return entry;
+    }
+
+    return NULL;
+}
+
+//------------------------------------
+// unmount a pooled drive and free its slot
+//------------------------------------
+static int pool_unmount(DSK_PoolEntry *entry)
+{
+    int result = dsk_unmount_drive(entry->drv);
+
+    free(entry->path);
+    memset(entry, 0, sizeof(DSK_PoolEntry));
+
+    return result;
+}
+
+//------------------------------------
+// return a mounted drive for filename, mounting it if needed
+// each call must be matched by dsk_pool_release
+//------------------------------------
+DSK_Drive *dsk_pool_get(DSK_Pool *pool, const char *filename)
+{
+    assert(pool && filename);
+    if (!pool || !filename)
+        return NULL;
+
+    char *path = pool_path(filename);
+    if (!path)
+    {
+        dsk_printf(NULL, "Disk (%s) not found.\n", filename);
+        return NULL;
+    }
+
+    mutex_lock(pool->lock);
+
+    // a slot with no drive is being mounted by another thread
+    DSK_PoolEntry *entry;
+    while ((entry = pool_find(pool, path, NULL)) && !entry->drv)
+        pool_wait(pool);
+
+    if (entry)
+    {
+        entry->refs++;
+        entry->last_used = ++pool->clock;
+
+        DSK_Drive *drv = entry->drv;
+
+        mutex_unlock(pool->lock);
+        free(path);
+
+        return drv;
+    }
+
+    // use a free slot, else evict the least recently used idle drive
+    // drives in a transaction are kept, unmounting would roll them back
+    for (int i = 0; i < pool->size; i++)
+    {
+        DSK_PoolEntry *e = &pool->entries[i];
+
+        if (!e->path)
+        {
+            entry = e;
+            break;
+        }
+
+        if (!e->refs && !e->drv->in_transaction && (!entry || e->last_used < entry->last_used))
+            entry = e;
+    }
+
+    if (!entry)
+    {
+        dsk_printf(NULL, "drive pool full.\n");
+        mutex_unlock(pool->lock);
+        free(path);
+        return NULL;
+    }
+
+    // the evicted drive is unmounted under the lock, so its image
+    // cannot be mounted again before its changes are written
+    if (entry->path)
+    {
+        DSK_TRACE("evicting '%s'\n", entry->path);
+        pool_unmount(entry);
+    }
+
+    // reserve the slot, then mount without holding up other images
+    entry->path = path;
+    entry->refs = 1;
+    entry->last_used = ++pool->clock;
+
+    mutex_unlock(pool->lock);
+
+    DSK_Drive *drv = dsk_mount_drive_ex(path, pool->flags);
+
+    mutex_lock(pool->lock);
+
+    if (drv)
+        entry->drv = drv;
+    else
+    {
+        free(entry->path);
+        memset(entry, 0, sizeof(DSK_PoolEntry));
+    }
+
+    pool_wake(pool);
+    mutex_unlock(pool->lock);
+
+    return drv;
+}
+
+//------------------------------------
+// drop a reference taken by dsk_pool_get, the drive stays mounted
+//------------------------------------
+int dsk_pool_release(DSK_Pool *pool, DSK_Drive *drv)
+{
+    assert(pool && drv);
+    if (!pool || !drv)
+        return E_FAIL;
+
+    mutex_lock(pool->lock);
+
+    DSK_PoolEntry *entry = pool_find(pool, NULL, drv);
+    if (entry && entry->refs > 0)
+        entry->refs--;
+
+    mutex_unlock(pool->lock);
+
+    if (!entry)
+    {
+        dsk_printf(drv, "drive not in pool.\n");
+        return E_FAIL;
+    }
+
+    return E_OK;
+}
+
+//------------------------------------
+// unmount filename if it is pooled and unused, e.g. before replacing it
+//------------------------------------
+int dsk_pool_evict(DSK_Pool *pool, const char *filename)
+{
+    assert(pool && filename);
+    if (!pool || !filename)
+        return E_FAIL;
+
+    // files that do not exist cannot be pooled
+    char *path = pool_path(filename);
+    if (!path)
+        return E_OK;
+
+    int result = E_OK;
+
+    mutex_lock(pool->lock);
+
+    DSK_PoolEntry *entry = pool_find(pool, path, NULL);
+    if (entry)
+    {
+        if (entry->refs)
+        {
+            dsk_printf(entry->drv, "Disk (%s) in use.\n", filename);
+            result = E_FAIL;
+        }
+        else
+        {
+            result = pool_unmount(entry);
+        }
+    }
+
+    mutex_unlock(pool->lock);
+    free(path);
+
+    return result;
+}
+
+//------------------------------------
+// flush every pooled drive
+//------------------------------------
+int dsk_pool_flush(DSK_Pool *pool)
+{
+    int result = E_OK;
+
+    assert(pool);
+    if (!pool)
+        return E_FAIL;
+
+    mutex_lock(pool->lock);
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (pool->entries[i].drv && dsk_flush(pool->entries[i].drv))
+            result = E_FAIL;
+    }
+
+    mutex_unlock(pool->lock);
+
+    return result;
+}
+
+//------------------------------------
+// unmount every pooled drive and free the pool
+//------------------------------------
+int dsk_pool_free(DSK_Pool *pool)
+{
+    int result = E_OK;
+
+    if (!pool)
+        return E_FAIL;
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        DSK_PoolEntry *entry = &pool->entries[i];
+
+        if (!entry->path)
+            continue;
+
+        assert(!entry->refs);
+        if (pool_unmount(entry))
+            result = E_FAIL;
+    }
+
+#ifndef _WIN32
+    pthread_cond_destroy(&pool->mounted);
+#endif
+    lock_free(pool->lock);
+    free(pool);
+
+    return result;
+}
+
+//------------------------------------
+// read only handles
+//
+// A handle records only where an image lives and how big it is. The
+// drive, with its FAT, directory and indexes, is built by
+// dsk_handle_drive and dropped again by dsk_handle_release, and no file
+// is held open in between, so very many images can be kept at hand.
+// A handle is used by one thread at a time.
+//------------------------------------
+static DSK_Handle *handle_new(const char *filename, const void *base, long offset, long size)
+{
+    if (!image_tracks(size))
+        return NULL;
+
+    DSK_Handle *h = calloc(1, sizeof(DSK_Handle));
+    if (!h || (filename && !(h->filename = strdup(filename))))
+    {
+        dsk_printf(NULL, "out of memory.\n");
+        free(h);
+        return NULL;
+    }
+
+    h->base = base;
+    h->offset = offset;
+    h->size = size;
+
+    return h;
+}
+
+//------------------------------------
+// return a handle to the image at offset in filename
+// a size of 0 means the rest of the file
+//------------------------------------
+DSK_Handle *dsk_handle_open(const char *filename, long offset, long size)
+{
+    assert(filename && offset >= 0);
+
+    FILE *fp = filename && offset >= 0 ? fopen(filename, "rb") : NULL;
+    if (!fp)
+    {
+        dsk_printf(NULL, "Disk (%s) not found.\n", filename);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fclose(fp);
+
+    if (!size)
+        size = file_size - offset;
+
+    if (offset + size > file_size)
+    {
+        dsk_printf(NULL, "Disk (%s) too short.\n", filename);
+        return NULL;
+    }
+
+    return handle_new(filename, NULL, offset, size);
+}
+
+//------------------------------------
+// return a handle to an image in memory, e.g. in a shared mapping
+// the memory must stay valid until dsk_handle_close
+//------------------------------------
+DSK_Handle *dsk_handle_memory(const void *image, long size)
+{
+    assert(image);
+    if (!image)
+        return NULL;
+
+    return handle_new(NULL, image, 0, size);
+}
+
+//------------------------------------
+// bring a file handle's image into memory
+//------------------------------------
+static const uint8_t *handle_map(DSK_Handle *h)
+{
+#ifdef DSK_HAVE_MMAP
+    // mappings start on a page boundary
+    long page = sysconf(_SC_PAGESIZE);
+    long skip = h->offset % page;
+
+    int fd = open(h->filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    void *p = mmap(NULL, h->size + skip, PROT_READ, MAP_SHARED, fd, h->offset - skip);
+    close(fd);
+
+    if (p == MAP_FAILED)
+        return NULL;
+
+    h->map = p;
+
+    return h->map + skip;
+#else
+    FILE *fp = fopen(h->filename, "rb");
+    if (!fp)
+        return NULL;
+
+    h->map = malloc(h->size);
+    if (h->map && (fseek(fp, h->offset, SEEK_SET) || fread(h->map, h->size, 1, fp) != 1))
+    {
+        free(h->map);
+        h->map = NULL;
+    }
+
+    fclose(fp);
+
+    return h->map;
+#endif
+}
+
+//------------------------------------
+// release a file handle's image
+//------------------------------------
+static void handle_unmap(DSK_Handle *h)
+{
+    if (!h->map)
+        return;
+
+#ifdef DSK_HAVE_MMAP
+    munmap(h->map, h->size + h->offset % sysconf(_SC_PAGESIZE));
+#else
+    free(h->map);
+#endif
+
+    h->map = NULL;
+}
+
+//------------------------------------
+// return the read only drive for a handle, building it if needed
+// the drive works with the listing and extract functions
+//------------------------------------
+DSK_Drive *dsk_handle_drive(DSK_Handle *h)
+{
+    assert(h);
+    if (!h)
+        return NULL;
+
+    if (h->drv)
+        return h->drv;
+
+    const uint8_t *image = h->base ? h->base : handle_map(h);
+    if (!image)
+    {
+        dsk_printf(NULL, "Disk (%s) unreadable.\n", h->filename);
+        return NULL;
+    }
+
+    h->drv = mount_image((uint8_t *)image, h->size, TRUE);
+    if (!h->drv)
+        handle_unmap(h);
+    else if (h->filename)
+        snprintf(h->drv->filename, sizeof(h->drv->filename), "%s", h->filename);
+
+    return h->drv;
+}
+
+//------------------------------------
+// drop a handle's drive, the handle stays usable
+//------------------------------------
+int dsk_handle_release(DSK_Handle *h)
+{
+    int result = E_OK;
+
+    assert(h);
+    if (!h)
+        return E_FAIL;
+
+    if (h->drv)
+        result = dsk_unmount_drive(h->drv);
+
+    h->drv = NULL;
+    handle_unmap(h);
+
+    return result;
+}
+
+//------------------------------------
+// release and free a handle
+//------------------------------------
+int dsk_handle_close(DSK_Handle *h)
+{
+    if (!h)
+        return E_FAIL;
+
+    int result = dsk_handle_release(h);
+
+    free(h->filename);
+    free(h);
+
+    return result;
+}
+
+//------------------------------------
+// library entry points, each holds the drive lock for the call
+//------------------------------------
+int dsk_dir(DSK_Drive *drv)
+{
+    drive_lock(drv, FALSE);
+    int result = dir_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_granule_map(DSK_Drive *drv)
+{
+    drive_lock(drv, FALSE);
+    int result = granule_map_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_free_bytes(DSK_Drive *drv)
+{
+    drive_lock(drv, FALSE);
+    int result = free_bytes_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_free_granules(DSK_Drive *drv)
+{
+    drive_lock(drv, FALSE);
+    int result = free_granules_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_extract_file(DSK_Drive *drv, const char *filename)
+{
+    drive_lock(drv, FALSE);
+    int result = extract_file_locked(drv, filename);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_extract_all(DSK_Drive *drv, const char *pattern)
+{
+    drive_lock(drv, FALSE);
+    int result = extract_all_locked(drv, pattern);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_extract_to_sink(DSK_Drive *drv, const char *filename, DSK_Sink sink, void *ctx)
+{
+    drive_lock(drv, FALSE);
+    int result = extract_to_sink_locked(drv, filename, sink, ctx);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+long dsk_read_file_to_buffer(DSK_Drive *drv, const char *filename, void *buf, size_t size)
+{
+    drive_lock(drv, FALSE);
+    long result = read_file_to_buffer_locked(drv, filename, buf, size);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+long dsk_file_size(DSK_Drive *drv, const char *filename)
+{
+    drive_lock(drv, FALSE);
+    long result = file_size_locked(drv, filename);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_file_layout(DSK_Drive *drv, const char *filename, DSK_FileLayout *layout)
+{
+    drive_lock(drv, FALSE);
+    int result = file_layout_locked(drv, filename, layout);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_layout(DSK_Drive *drv, DSK_Layout *layout)
+{
+    drive_lock(drv, FALSE);
+    int result = layout_locked(drv, layout);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_cache_stats(DSK_Drive *drv, DSK_CacheStats *stats)
+{
+    drive_lock(drv, FALSE);
+    int result = cache_stats_locked(drv, stats);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+DSK_File *dsk_open(DSK_Drive *drv, const char *filename)
+{
+    drive_lock(drv, FALSE);
+    DSK_File *result = open_locked(drv, filename);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+long dsk_read(DSK_File *file, void *buf, long size)
+{
+    DSK_Drive *drv = file ? file->drv : NULL;
+
+    drive_lock(drv, FALSE);
+    long result = read_locked(file, buf, size);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+long dsk_pread(DSK_File *file, void *buf, long size, long offset)
+{
+    DSK_Drive *drv = file ? file->drv : NULL;
+
+    drive_lock(drv, FALSE);
+    long result = pread_locked(file, buf, size, offset);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_set_drive_output(DSK_Drive *drv, DSK_Print f)
+{
+    drive_lock(drv, TRUE);
+    int result = set_drive_output_locked(drv, f);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_set_cache_size(DSK_Drive *drv, int tracks)
+{
+    drive_lock(drv, TRUE);
+    int result = set_cache_size_locked(drv, tracks);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_set_alloc_policy(DSK_Drive *drv, DSK_ALLOC_POLICY policy)
+{
+    drive_lock(drv, TRUE);
+    int result = set_alloc_policy_locked(drv, policy);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_save(DSK_Drive *drv, const char *filename)
+{
+    drive_lock(drv, TRUE);
+    int result = save_locked(drv, filename);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_add_file(DSK_Drive *drv, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    drive_lock(drv, TRUE);
+    int result = add_file_locked(drv, filename, mode, type);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_add_stream(DSK_Drive *drv, FILE *fin, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    drive_lock(drv, TRUE);
+    int result = add_stream_locked(drv, fin, filename, mode, type);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_write_file_from_buffer(DSK_Drive *drv, const char *filename, const void *buf, size_t size, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    drive_lock(drv, TRUE);
+    int result = write_file_from_buffer_locked(drv, filename, buf, size, mode, type);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_add_files(DSK_Drive *drv, const char **filenames, int count, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    drive_lock(drv, TRUE);
+    int result = add_files_locked(drv, filenames, count, mode, type);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+DSK_File *dsk_create(DSK_Drive *drv, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type)
+{
+    drive_lock(drv, TRUE);
+    DSK_File *result = create_locked(drv, filename, mode, type);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+long dsk_write(DSK_File *file, const void *buf, long size)
+{
+    DSK_Drive *drv = file ? file->drv : NULL;
+
+    drive_lock(drv, TRUE);
+    long result = write_locked(file, buf, size);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_close(DSK_File *file)
+{
+    DSK_Drive *drv = file ? file->drv : NULL;
+
+    drive_lock(drv, file && file->writable);
+    int result = close_locked(file);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_del(DSK_Drive *drv, const char *filename)
+{
+    drive_lock(drv, TRUE);
+    int result = del_locked(drv, filename);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_defrag(DSK_Drive *drv)
+{
+    drive_lock(drv, TRUE);
+    int result = defrag_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_check(DSK_Drive *drv, int repair)
+{
+    drive_lock(drv, repair);
+    int result = check_locked(drv, repair);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_flush(DSK_Drive *drv)
+{
+    drive_lock(drv, TRUE);
+    int result = flush_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_begin(DSK_Drive *drv)
+{
+    drive_lock(drv, TRUE);
+    int result = begin_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_commit(DSK_Drive *drv)
+{
+    drive_lock(drv, TRUE);
+    int result = commit_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_rollback(DSK_Drive *drv)
+{
+    drive_lock(drv, TRUE);
+    int result = rollback_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_format(DSK_Drive *drv)
+{
+    drive_lock(drv, TRUE);
+    int result = format_locked(drv);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_rename(DSK_Drive *drv, char *current_file, char *new_file)
+{
+    drive_lock(drv, TRUE);
+    int result = rename_locked(drv, current_file, new_file);
+    drive_unlock(drv);
+
+    return result;
+}
+
+//
+int dsk_unmount_drive(DSK_Drive *drv)
+{
+    drive_lock(drv, TRUE);
+    int result = unmount_drive_locked(drv);
+    drive_unlock(drv);
+
+    // other threads must be done with drv by now
+    if (result == E_OK)
+    {
+        drive_lock_free(drv);
+        free(drv);
+    }
+
+    return result;
+}
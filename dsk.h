@@ -22,14 +22,18 @@
 #define DSK_DIR_TRACK               17
 #define DSK_FAT_SECTOR              2
 #define DSK_DIRECTORY_SECTOR        3
+#define DSK_METADATA_SECTORS        10  // FAT sector and 9 directory sectors
 #define DSK_GRANULES_PER_TRACK      2
 #define DSK_DIR_START_GRANULE       (DSK_DIR_TRACK * DSK_GRANULES_PER_TRACK)
 #define DSK_SECTORS_PER_GRANULE     (DSK_SECTORS_PER_TRACK / DSK_GRANULES_PER_TRACK)
 #define DSK_BYTES_PER_GRANULE       (DSK_SECTORS_PER_GRANULE * DSK_BYTES_DATA_PER_SECTOR)
 #define DSK_TOTAL_GRANULES          ((drv->num_tracks - 1) * DSK_GRANULES_PER_TRACK)
+#define DSK_MAX_GRANULES            ((DSK_MAX_TRACKS - 1) * DSK_GRANULES_PER_TRACK)
+#define DSK_FREE_MAP_WORDS          ((DSK_MAX_GRANULES + 31) / 32)
 #define DSK_MAX_FILENAME            8
 #define DSK_MAX_EXT                 3
 #define DSK_MAX_DIR_ENTRIES         72
+#define DSK_DIR_HASH_SIZE           128 // power of 2, > DSK_MAX_DIR_ENTRIES
 #define DSK_DIRENT_FREE             0xFF
 #define DSK_DIRENT_DELETED          0
 #define DSK_GRANULE_FREE            0xFF
@@ -41,6 +45,18 @@
 #define DSK_ENCODING_ASCII          0xFF
 #define DSK_ENCODING_BINARY         0
 
+// mount flags
+#define DSK_MOUNT_DEFAULT           0
+#define DSK_MOUNT_MMAP              1   // map the image into memory
+#define DSK_MOUNT_CHECK             2   // fail the mount if dsk_check finds problems
+
+// dsk_new_ex flags
+#define DSK_NEW_DEFAULT             0
+#define DSK_NEW_SPARSE              1   // leave data tracks as holes
+
+#define DSK_DEFAULT_CACHE_TRACKS    8
+#define DSK_DEFAULT_POOL_SIZE       8
+
 // error return codes
 #ifndef E_OK
 #   define E_OK 0
@@ -92,6 +108,14 @@ typedef enum
     DSK_MODE_ASCII
 } DSK_OPEN_MODE;
 
+// granule allocation policies
+typedef enum
+{
+    DSK_ALLOC_FIRST_FIT,            // first free run that holds the file
+    DSK_ALLOC_BEST_FIT,             // smallest free run that holds the file
+    DSK_ALLOC_NEXT_FIT              // first free run after the last allocation
+} DSK_ALLOC_POLICY;
+
 // DSK file types
 typedef enum
 {
@@ -138,6 +162,68 @@ typedef struct
     uint8_t granule_map[DSK_BYTES_DATA_PER_SECTOR];
 } DSK_FAT;
 
+//--------------------------------------
+// track cache entry
+//--------------------------------------
+typedef struct
+{
+    int track;                      // cached track, -1 if unused
+    int dirty;                      // true if track must be written back
+    unsigned long last_used;        // LRU stamp
+    uint8_t data[DSK_BYTES_DATA_PER_TRACK];
+} DSK_CacheEntry;
+
+//--------------------------------------
+// track cache statistics
+//--------------------------------------
+typedef struct
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long writebacks;
+} DSK_CacheStats;
+
+//--------------------------------------
+// layout of one file's granule chain
+//--------------------------------------
+typedef struct
+{
+    int granules;
+    int extents;                    // runs of consecutive granules
+    int seek_tracks;                // tracks stepped over reading the chain in order
+} DSK_FileLayout;
+
+//--------------------------------------
+// layout of a whole DSK
+//--------------------------------------
+typedef struct
+{
+    int files;
+    int used_granules;
+    int extents;                    // total over all files
+    int fragmented_files;           // files in more than one extent
+    long seek_tracks;               // total over all files
+    int free_granules;
+    int free_runs;                  // runs of consecutive free granules
+    int largest_free_run;
+} DSK_Layout;
+
+//--------------------------------------
+// granule chain of a file, built on demand
+//--------------------------------------
+typedef struct
+{
+    unsigned long generation;       // FAT generation the chain was built from
+    int first_granule;
+    int count;                      // granules in chain
+    int tail_sectors;               // sectors used in last granule
+    uint8_t granules[DSK_MAX_GRANULES];
+} DSK_Chain;
+
+typedef void (*DSK_Print)(const char *s);
+
+struct DSK_Lock;
+
 //--------------------------------------
 // represents a mounted disk drive
 //--------------------------------------
@@ -152,8 +238,73 @@ typedef struct
 
     int num_tracks;
     int num_sides;
+
+    uint8_t *image;                 // memory mapped image, NULL if not mapped
+    long image_size;
+
+    char dir_names[DSK_MAX_DIR_ENTRIES][DSK_MAX_FILENAME + DSK_MAX_EXT + 2];   // "NAME.EXT", empty if unused
+    int8_t dir_index[DSK_DIR_HASH_SIZE];    // hash of dir_names to entry, -1 if empty
+
+    uint32_t free_map[DSK_FREE_MAP_WORDS];  // bit set for each free granule
+    int free_granules;              // count of free granules
+
+    unsigned long fat_generation;   // changes whenever the FAT does
+    DSK_Chain *chains[DSK_MAX_DIR_ENTRIES]; // per entry granule chains, NULL until used
+
+    DSK_ALLOC_POLICY alloc_policy;  // how granules are chosen for new files
+    int next_fit_granule;           // next fit search start
+
+    DSK_CacheEntry *cache;          // write-back track cache, NULL if disabled
+    int cache_size;                 // number of cached tracks
+    unsigned long cache_clock;
+    DSK_CacheStats cache_stats;
+
+    uint8_t meta_shadow[DSK_METADATA_SECTORS][DSK_BYTES_DATA_PER_SECTOR];  // FAT and DIR as on the DSK
+
+    int in_transaction;             // metadata writes deferred until commit, meta_shadow holds the rollback
+
+    int read_only;                  // TRUE for drives from a DSK_Handle, which owns the image
+
+    struct DSK_Lock *lock;          // reader/writer lock, held by each library call
+    DSK_Print output;               // messages for this drive, NULL uses dsk_set_output_function's
 } DSK_Drive;
 
+//--------------------------------------
+// an open file on a mounted drive
+//--------------------------------------
+typedef struct
+{
+    DSK_Drive *drv;
+    DSK_DirEntry *dirent;
+    int writable;                   // TRUE if created with dsk_create
+    long pos;                       // current offset in file
+    long size;                      // file size in bytes
+
+    int chain_index;                // cursor position in the granule chain
+    int granule;                    // granule at chain_index, -1 if not set
+
+    int buf_index;                  // chain position held in buf, -1 if empty
+    int buf_granule;
+    int buf_dirty;
+    char buf[DSK_BYTES_PER_GRANULE];
+} DSK_File;
+
+// a set of mounted drives shared between users, see dsk_pool_new
+typedef struct DSK_Pool DSK_Pool;
+
+//--------------------------------------
+// a read only image, only mounted while its drive is in use
+//--------------------------------------
+typedef struct
+{
+    char *filename;                 // NULL for images in memory
+    const uint8_t *base;            // image in memory, NULL for files
+    long offset;                    // image offset in the file
+    long size;                      // image size in bytes
+    uint8_t *map;                   // file contents while the drive exists
+    DSK_Drive *drv;                 // NULL until dsk_handle_drive
+} DSK_Handle;
+
 //--------------------------------------
 // represents a JVC header
 //--------------------------------------
@@ -166,7 +317,8 @@ typedef struct
     uint8_t sector_attribute_flag;
 } DSK_HEADER;
 
-typedef void (*DSK_Print)(const char *s);
+// receives extracted file data, return E_FAIL to stop
+typedef int (*DSK_Sink)(void *ctx, const void *data, size_t size);
 
 #ifdef DSK_DEBUG
 #   define DSK_TRACE(...) fprintf(stderr, __VA_ARGS__)
@@ -179,24 +331,69 @@ typedef void (*DSK_Print)(const char *s);
 //--------------------------------------
 int dsk_seek_drive(DSK_Drive *drv, int track, int sector);
 DSK_Drive *dsk_mount_drive(const char *filename);
+DSK_Drive *dsk_mount_drive_ex(const char *filename, int flags);
+DSK_Drive *dsk_mount_memory(const void *image, long size);
+DSK_Drive *dsk_new_memory(int tracks, int sides);
+int dsk_save(DSK_Drive *drv, const char *filename);
+uint8_t *dsk_sector_ptr(DSK_Drive *drv, int track, int sector);
+uint8_t *dsk_granule_ptr(DSK_Drive *drv, int granule);
 int dsk_unmount_drive(DSK_Drive *drv);
 int dsk_dir(DSK_Drive *drv);
 int dsk_granule_map(DSK_Drive *drv);
 int dsk_free_bytes(DSK_Drive *drv);
 int dsk_free_granules(DSK_Drive *drv);
 int dsk_add_file(DSK_Drive *drv, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type);
+int dsk_add_stream(DSK_Drive *drv, FILE *fin, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type);
+int dsk_add_files(DSK_Drive *drv, const char **filenames, int count, DSK_OPEN_MODE mode, DSK_FILE_TYPE type);
 int dsk_extract_file(DSK_Drive *drv, const char *filename);
+int dsk_extract_all(DSK_Drive *drv, const char *pattern);
+int dsk_extract_to_sink(DSK_Drive *drv, const char *filename, DSK_Sink sink, void *ctx);
+long dsk_read_file_to_buffer(DSK_Drive *drv, const char *filename, void *buf, size_t size);
+int dsk_write_file_from_buffer(DSK_Drive *drv, const char *filename, const void *buf, size_t size, DSK_OPEN_MODE mode, DSK_FILE_TYPE type);
 DSK_Drive *dsk_new(char *filename, int tracks, int sides);
+DSK_Drive *dsk_new_ex(char *filename, int tracks, int sides, int flags);
+int dsk_copy_image(const char *src_filename, const char **filenames, int count);
 int dsk_format(DSK_Drive *drv);
 int dsk_flush(DSK_Drive *drv);
+int dsk_begin(DSK_Drive *drv);
+int dsk_commit(DSK_Drive *drv);
+int dsk_rollback(DSK_Drive *drv);
 int dsk_del(DSK_Drive *drv, const char *filename);
+int dsk_defrag(DSK_Drive *drv);
+int dsk_check(DSK_Drive *drv, int repair);
 void dsk_set_output_function(DSK_Print f);
+int dsk_set_drive_output(DSK_Drive *drv, DSK_Print f);
 int dsk_rename(DSK_Drive *drv, char *file1, char *file2);
+int dsk_set_cache_size(DSK_Drive *drv, int tracks);
+int dsk_set_alloc_policy(DSK_Drive *drv, DSK_ALLOC_POLICY policy);
+int dsk_cache_stats(DSK_Drive *drv, DSK_CacheStats *stats);
+long dsk_file_size(DSK_Drive *drv, const char *filename);
+int dsk_file_layout(DSK_Drive *drv, const char *filename, DSK_FileLayout *layout);
+int dsk_layout(DSK_Drive *drv, DSK_Layout *layout);
+
+// drive pools, drives from dsk_pool_get are unmounted by the pool
+DSK_Pool *dsk_pool_new(int size, int flags);
+DSK_Drive *dsk_pool_get(DSK_Pool *pool, const char *filename);
+int dsk_pool_release(DSK_Pool *pool, DSK_Drive *drv);
+int dsk_pool_evict(DSK_Pool *pool, const char *filename);
+int dsk_pool_flush(DSK_Pool *pool);
+int dsk_pool_free(DSK_Pool *pool);
+
+// read only handles
+DSK_Handle *dsk_handle_open(const char *filename, long offset, long size);
+DSK_Handle *dsk_handle_memory(const void *image, long size);
+DSK_Drive *dsk_handle_drive(DSK_Handle *h);
+int dsk_handle_release(DSK_Handle *h);
+int dsk_handle_close(DSK_Handle *h);
 
-// future API ideas
-// int dsk_open();
-// int dsk_write();
-// int dsk_read();
-// int dsk_close();
+// file handles, data is read and written without translation
+DSK_File *dsk_open(DSK_Drive *drv, const char *filename);
+DSK_File *dsk_create(DSK_Drive *drv, const char *filename, DSK_OPEN_MODE mode, DSK_FILE_TYPE type);
+long dsk_read(DSK_File *file, void *buf, long size);
+long dsk_pread(DSK_File *file, void *buf, long size, long offset);
+long dsk_write(DSK_File *file, const void *buf, long size);
+int dsk_seek(DSK_File *file, long offset, int whence);
+long dsk_tell(DSK_File *file);
+int dsk_close(DSK_File *file);
 
 #endif  // __DSK_H
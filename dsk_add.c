@@ -1,31 +1,55 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include "dsk.h"
 
+#ifndef _WIN32
+#   include <glob.h>
+#endif
+
+//
+static int is_dsk_file(const char *s)
+{
+    size_t len = strlen(s);
+
+    return len > 4 && !strcasecmp(s + len - 4, ".dsk");
+}
+
 //
 int main(int argc, char *argv[])
 {
     if (argc < 3)
     {
-        puts("usage: dsk_add filename dskfile [ASCII|BINARY] [BASIC|ML|TEXT|DATA]");
+        puts("usage: dsk_add filename [filename ...] dskfile [ASCII|BINARY] [BASIC|ML|TEXT|DATA]");
         exit(E_FAIL);
     }
 
-    DSK_Drive *drv = dsk_mount_drive(argv[2]);
+    // the DSK file is the last .DSK argument, or the second for a single file
+    int dsk_arg = 2;
+    for (int i = argc - 1; i > 1; i--)
+    {
+        if (is_dsk_file(argv[i]))
+        {
+            dsk_arg = i;
+            break;
+        }
+    }
+
+    DSK_Drive *drv = dsk_mount_drive_ex(argv[dsk_arg], DSK_MOUNT_MMAP);
     if (!drv)
     {
-        printf("error: unable to mount DSK file %s\n", argv[1]);
+        printf("error: unable to mount DSK file %s\n", argv[dsk_arg]);
         return E_FAIL;
     }
 
     // look for optional file mode and type
-    char *pmode = argc > 3 ? argv[3] : NULL;
+    char *pmode = argc > dsk_arg + 1 ? argv[dsk_arg + 1] : NULL;
     DSK_OPEN_MODE mode = DSK_MODE_BINARY;
     if (pmode && toupper(pmode[0]) == 'A')
         mode = DSK_MODE_ASCII;
 
-    char *ptype = argc > 4 ? argv[4] : NULL;
+    char *ptype = argc > dsk_arg + 2 ? argv[dsk_arg + 2] : NULL;
     DSK_FILE_TYPE type = DSK_TYPE_ML;
     if (ptype)
     {
@@ -37,10 +61,41 @@ int main(int argc, char *argv[])
             type = DSK_TYPE_TEXT;
     }
 
-    if (dsk_add_file(drv, argv[1], mode, type))
-        return E_FAIL;
+    const char **files = (const char **)argv + 1;
+    int count = dsk_arg - 1;
+
+#ifndef _WIN32
+    // expand any wildcards the shell left alone (e.g. quoted patterns)
+    glob_t g;
+    int flags = 0;
 
-    printf("dsk_add: file '%s' added.\n", argv[1]);
+    memset(&g, 0, sizeof(g));
+    for (int i = 0; i < count; i++)
+    {
+        if (glob(files[i], flags | GLOB_NOCHECK, NULL, &g) == 0)
+            flags = GLOB_APPEND;
+    }
+
+    if (g.gl_pathc)
+    {
+        files = (const char **)g.gl_pathv;
+        count = g.gl_pathc;
+    }
+#endif
+
+    int result = dsk_add_files(drv, files, count, mode, type);
+    if (result == E_OK)
+    {
+        for (int i = 0; i < count; i++)
+            printf("dsk_add: file '%s' added.\n", files[i]);
+    }
+
+#ifndef _WIN32
+    globfree(&g);
+#endif
+
+    if (result)
+        return E_FAIL;
 
     return dsk_unmount_drive(drv);
 }
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dsk.h"
+
+//
+int main(int argc, char *argv[])
+{
+    int repair = argc > 1 && !strcmp(argv[1], "-r");
+
+    if (argc < 2 + repair)
+    {
+        puts("usage: dsk_check [-r] dskfile");
+        exit(E_FAIL);
+    }
+
+    char *dskfile = argv[1 + repair];
+
+    DSK_Drive *drv = dsk_mount_drive(dskfile);
+    if (!drv)
+    {
+        printf("error: unable to mount DSK file %s\n", dskfile);
+        return E_FAIL;
+    }
+
+    int problems = dsk_check(drv, repair);
+    if (problems < 0)
+        return E_FAIL;
+
+    if (!problems)
+        printf("dsk_check: %s is OK.\n", dskfile);
+    else
+        printf("dsk_check: %d problems %s in %s.\n", problems, repair ? "repaired" : "found", dskfile);
+
+    if (dsk_unmount_drive(drv))
+        return E_FAIL;
+
+    return problems && !repair ? E_FAIL : E_OK;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include "dsk.h"
 
@@ -8,21 +9,33 @@ int main(int argc, char *argv[])
 {
     if (argc < 3)
     {
-        puts("usage: dsk_extract filename dskfile");
+        puts("usage: dsk_extract filename|pattern dskfile");
         exit(E_FAIL);
     }
 
-    DSK_Drive *drv = dsk_mount_drive(argv[2]);
+    DSK_Drive *drv = dsk_mount_drive_ex(argv[2], DSK_MOUNT_MMAP);
     if (!drv)
     {
         printf("error: unable to mount DSK file %s\n", argv[1]);
         return E_FAIL;
     }
 
-    if (dsk_extract_file(drv, argv[1]))
-        return E_FAIL;
+    // wildcards extract every matching file in one pass
+    if (strpbrk(argv[1], "*?"))
+    {
+        int count = dsk_extract_all(drv, argv[1]);
+        if (count < 0)
+            return E_FAIL;
+
+        printf("%d files extracted.\n", count);
+    }
+    else
+    {
+        if (dsk_extract_file(drv, argv[1]))
+            return E_FAIL;
 
-    printf("%s extracted.\n", argv[1]);
+        printf("%s extracted.\n", argv[1]);
+    }
 
     return dsk_unmount_drive(drv);
 }
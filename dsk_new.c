@@ -1,27 +1,84 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include "dsk.h"
 
+//
+static int is_number(const char *s)
+{
+    if (!*s)
+        return 0;
+
+    for (; *s; s++)
+        if (!isdigit((unsigned char)*s))
+            return 0;
+
+    return 1;
+}
+
 //
 int main(int argc, char *argv[])
 {
     if (argc < 2)
     {
-        puts("usage: dsk_new filename [tracks [sides]]");
+        puts("usage: dsk_new [-s] filename [filename ...] [tracks [sides]]");
+        exit(E_FAIL);
+    }
+
+    // -s leaves data tracks as holes
+    int flags = DSK_NEW_DEFAULT;
+    int first = 1;
+    if (!strcmp(argv[first], "-s"))
+    {
+        flags = DSK_NEW_SPARSE;
+        first++;
+    }
+
+    // filenames come first, then optional tracks and sides
+    int count = 0;
+    while (first + count < argc && !is_number(argv[first + count]))
+        count++;
+
+    if (!count)
+    {
+        puts("error: missing filename");
         exit(E_FAIL);
     }
 
-    int tracks = argc > 2 ? atoi(argv[2]) : 35;
-    int sides = argc > 3 ? atoi(argv[3]) : 1;
+    int next = first + count;
+    int tracks = argc > next ? atoi(argv[next]) : 35;
+    int sides = argc > next + 1 ? atoi(argv[next + 1]) : 1;
 
-    DSK_Drive *drv = dsk_new(argv[1], tracks, sides);
+    // names are upper case, as dsk_new makes them
+    for (int i = first; i < first + count; i++)
+        for (char *p = argv[i]; *p; p++)
+            *p = toupper((unsigned char)*p);
+
+    DSK_Drive *drv = dsk_new_ex(argv[first], tracks, sides, flags);
     if (!drv)
     {
-        printf("error: unable to create DSK file %s\n", argv[1]);
+        printf("error: unable to create DSK file %s\n", argv[first]);
         return E_FAIL;
     }
 
-    printf("%s created.\n", argv[1]);
-    
-    return dsk_unmount_drive(drv);
+    if (dsk_unmount_drive(drv))
+        return E_FAIL;
+
+    printf("%s created.\n", argv[first]);
+
+    // the rest are copies of the first
+    if (count > 1)
+    {
+        if (dsk_copy_image(argv[first], (const char **)argv + first + 1, count - 1))
+        {
+            puts("error: unable to create DSK files");
+            return E_FAIL;
+        }
+
+        for (int i = first + 1; i < first + count; i++)
+            printf("%s created.\n", argv[i]);
+    }
+
+    return E_OK;
 }
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "dsk.h"
+
+//
+// dsk_scan walks directories for .DSK images and scans them on a pool
+// of threads. Each image is hashed, checked and listed, printing tab
+// separated records:
+//
+//  image <path> <fnv1a64> <files> <free granules> <problems>
+//  file  <path> <name> <ext> <type> <A|B> <size> <granules>
+//  error <path> <message>
+//
+// Workers take images from their own queue and steal half of another
+// worker's remaining images when theirs runs dry.
+//
+
+#define MAX_THREADS     64
+#define RECORD_SIZE     (512 * (DSK_MAX_DIR_ENTRIES + 2))
+
+// records for one image, grown as needed for long paths
+typedef struct
+{
+    char *text;
+    size_t used, size;
+} Records;
+
+//
+typedef struct
+{
+    pthread_mutex_t lock;
+    int head, tail;         // images [head, tail) are still queued
+} WorkQueue;
+
+static char **g_paths;
+static int g_path_count, g_path_size;
+static WorkQueue g_queues[MAX_THREADS];
+static int g_threads;
+static pthread_mutex_t g_output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+static void quiet_output(const char *s)
+{
+}
+
+//
+static int is_dsk_file(const char *s)
+{
+    size_t len = strlen(s);
+
+    return len > 4 && !strcasecmp(s + len - 4, ".dsk");
+}
+
+//
+static void add_path(const char *path)
+{
+    if (g_path_count == g_path_size)
+    {
+        g_path_size = g_path_size ? g_path_size * 2 : 256;
+        g_paths = realloc(g_paths, g_path_size * sizeof(char *));
+        if (!g_paths)
+        {
+            puts("error: out of memory");
+            exit(E_FAIL);
+        }
+    }
+
+    g_paths[g_path_count++] = strdup(path);
+}
+
+// collect .DSK files below path. Only paths named on the command line
+// may be symbolic links, so a link loop cannot recurse forever.
+static void walk(const char *path, int top)
+{
+    struct stat st;
+
+    if (top ? stat(path, &st) : (lstat(path, &st) || S_ISLNK(st.st_mode)))
+        return;
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        if (is_dsk_file(path))
+            add_path(path);
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)))
+    {
+        char child[FILENAME_MAX];
+
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+        walk(child, FALSE);
+    }
+
+    closedir(dir);
+}
+
+// 64-bit FNV-1a
+static uint64_t hash_image(const uint8_t *data, long size)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (long i = 0; i < size; i++)
+        h = (h ^ data[i]) * 0x100000001b3ull;
+
+    return h;
+}
+
+// read a whole file into memory
+static uint8_t *read_image(const char *path, long *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+
+    uint8_t *data = NULL;
+
+    if (!fseek(fp, 0, SEEK_END) && (*size = ftell(fp)) > 0 && !fseek(fp, 0, SEEK_SET))
+    {
+        data = malloc(*size);
+        if (data && fread(data, *size, 1, fp) != 1)
+        {
+            free(data);
+            data = NULL;
+        }
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+// append a record, keeping what fits if out of memory
+static void add_record(Records *out, const char *format, ...)
+{
+    va_list valist;
+
+    va_start(valist, format);
+    int len = vsnprintf(out->text + out->used, out->size - out->used, format, valist);
+    va_end(valist);
+
+    if (len < 0)
+        return;
+
+    if (out->used + len >= out->size)
+    {
+        size_t size = (out->used + len + 1) * 2;
+        char *text = realloc(out->text, size);
+        if (!text)
+        {
+            out->used = strlen(out->text);
+            return;
+        }
+
+        out->text = text;
+        out->size = size;
+
+        va_start(valist, format);
+        vsnprintf(out->text + out->used, out->size - out->used, format, valist);
+        va_end(valist);
+    }
+
+    out->used += len;
+}
+
+// scan one image, records are built up in out and printed together
+static void scan_image(const char *path, Records *out)
+{
+    long size = 0;
+
+    uint8_t *data = read_image(path, &size);
+    if (!data)
+    {
+        add_record(out, "error\t%s\tcannot read file\n", path);
+        goto print;
+    }
+
+    uint64_t hash = hash_image(data, size);
+
+    // the image is read once, everything else works in memory
+    DSK_Drive *drv = dsk_mount_memory(data, size);
+    free(data);
+
+    if (!drv)
+    {
+        add_record(out, "error\t%s\tnot a DSK image\n", path);
+        goto print;
+    }
+
+    int problems = dsk_check(drv, FALSE);
+    int files = 0;
+
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        const char *name = drv->dir_names[i];
+        DSK_DirEntry *dirent = &drv->dirs[i];
+        DSK_FileLayout layout;
+
+        if (!name[0])
+            continue;
+
+        if (dsk_file_layout(drv, name, &layout))
+            layout.granules = -1;
+
+        const char *dot = strchr(name, '.');
+        int base_len = dot ? (int)(dot - name) : (int)strlen(name);
+
+        add_record(out, "file\t%s\t%.*s\t%s\t%d\t%c\t%ld\t%d\n",
+            path, base_len, name, dot ? dot + 1 : "", dirent->type,
+            dirent->binary_ascii == DSK_ENCODING_ASCII ? 'A' : 'B',
+            layout.granules < 0 ? -1L : dsk_file_size(drv, name), layout.granules);
+        files++;
+    }
+
+    add_record(out, "image\t%s\t%016llx\t%d\t%d\t%d\n",
+        path, (unsigned long long)hash, files, dsk_free_granules(drv), problems);
+
+    dsk_unmount_drive(drv);
+
+print:
+    pthread_mutex_lock(&g_output_lock);
+    fputs(out->text, stdout);
+    pthread_mutex_unlock(&g_output_lock);
+}
+
+// take the next image from our queue, or steal from another
+static int next_image(int self)
+{
+    WorkQueue *q = &g_queues[self];
+    int index = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+        index = q->head++;
+    pthread_mutex_unlock(&q->lock);
+
+    for (int i = 1; index < 0 && i < g_threads; i++)
+    {
+        WorkQueue *victim = &g_queues[(self + i) % g_threads];
+        int head = 0, tail = 0;
+
+        // steal the back half of the victim's queue
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->tail - victim->head;
+        if (remaining > 0)
+        {
+            tail = victim->tail;
+            head = tail - (remaining + 1) / 2;
+            victim->tail = head;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (head < tail)
+        {
+            index = head;
+
+            pthread_mutex_lock(&q->lock);
+            q->head = head + 1;
+            q->tail = tail;
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+
+    return index;
+}
+
+//
+static void *worker(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    Records out = { malloc(RECORD_SIZE), 0, RECORD_SIZE };
+    int index;
+
+    if (!out.text)
+        return NULL;
+
+    while ((index = next_image(self)) >= 0)
+    {
+        out.used = 0;
+        out.text[0] = 0;
+        scan_image(g_paths[index], &out);
+    }
+
+    free(out.text);
+
+    return NULL;
+}
+
+//
+int main(int argc, char *argv[])
+{
+    pthread_t threads[MAX_THREADS];
+    int arg = 1;
+
+    g_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc > 2 && !strcmp(argv[1], "-j"))
+    {
+        g_threads = atoi(argv[2]);
+        arg += 2;
+    }
+
+    if (arg >= argc)
+    {
+        puts("usage: dsk_scan [-j threads] path [path ...]");
+        exit(E_FAIL);
+    }
+
+    if (g_threads < 1)
+        g_threads = 1;
+    if (g_threads > MAX_THREADS)
+        g_threads = MAX_THREADS;
+
+    // library messages would get mixed into the records
+    dsk_set_output_function(quiet_output);
+
+    for (; arg < argc; arg++)
+        walk(argv[arg], TRUE);
+
+    if (g_threads > g_path_count)
+        g_threads = g_path_count ? g_path_count : 1;
+
+    // deal the images out evenly, stealing evens out the rest
+    for (int i = 0; i < g_threads; i++)
+    {
+        pthread_mutex_init(&g_queues[i].lock, NULL);
+        g_queues[i].head = (int)((long)g_path_count * i / g_threads);
+        g_queues[i].tail = (int)((long)g_path_count * (i + 1) / g_threads);
+    }
+
+    for (int i = 0; i < g_threads; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)i);
+
+    for (int i = 0; i < g_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < g_path_count; i++)
+        free(g_paths[i]);
+    free(g_paths);
+
+    return E_OK;
+}
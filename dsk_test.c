@@ -0,0 +1,859 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dsk.h"
+
+//
+// dsk_test runs the library test named on the command line, for ctest.
+// A failed check prints where it failed and the test exits with E_FAIL.
+//
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); return E_FAIL; } } while (0)
+
+#define TEXT_SIZE   (3 * DSK_BYTES_PER_GRANULE + 100)
+
+//
+typedef struct
+{
+    const char *name;
+    int (*fn)(void);
+} Test;
+
+// deterministic data, so a failure can be reproduced
+static unsigned int g_seed = 1;
+
+static unsigned int next_random(void)
+{
+    g_seed = g_seed * 1103515245 + 12345;
+    return (g_seed >> 16) & 0x7fff;
+}
+
+// write size bytes of buf to a host file
+static int write_host_file(const char *filename, const void *buf, size_t size)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+        return E_FAIL;
+
+    int result = size && fwrite(buf, size, 1, fp) != 1 ? E_FAIL : E_OK;
+
+    if (fclose(fp))
+        result = E_FAIL;
+
+    return result;
+}
+
+// host line endings to CoCo, one byte at a time
+static size_t reference_to_coco(char *dst, const char *src, size_t size)
+{
+    size_t j = 0;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (src[i] != 0x0a)
+            dst[j++] = src[i];
+        else if (!i || src[i - 1] != 0x0d)
+            dst[j++] = 0x0d;
+    }
+
+    return j;
+}
+
+// CoCo line endings to host, one byte at a time
+static size_t reference_from_coco(char *dst, const char *src, size_t size)
+{
+    size_t j = 0;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (src[i] != 0x0d)
+            dst[j++] = src[i];
+        else
+        {
+#ifdef _WIN32
+            dst[j++] = 0x0d;
+#endif
+            dst[j++] = 0x0a;
+        }
+    }
+
+    return j;
+}
+
+// check the stored and extracted forms of an ASCII file against text
+static int check_text_file(DSK_Drive *drv, const char *filename, const char *text, size_t size)
+{
+    static char coco[TEXT_SIZE], host[2 * TEXT_SIZE], stored[TEXT_SIZE], extracted[2 * TEXT_SIZE];
+
+    size_t coco_size = reference_to_coco(coco, text, size);
+    size_t host_size = reference_from_coco(host, coco, coco_size);
+
+    // dsk_read returns the bytes on the DSK untranslated
+    DSK_File *file = dsk_open(drv, filename);
+    CHECK(file);
+    CHECK(dsk_read(file, stored, sizeof(stored)) == (long)coco_size);
+    CHECK(!memcmp(stored, coco, coco_size));
+    CHECK(dsk_close(file) == E_OK);
+
+    CHECK(dsk_read_file_to_buffer(drv, filename, extracted, sizeof(extracted)) == (long)host_size);
+    CHECK(!memcmp(extracted, host, host_size));
+
+    return E_OK;
+}
+
+//------------------------------------
+// ASCII text round trips through add and extract exactly as the scalar
+// translation would, whichever kernel is selected. CRLF pairs and runs
+// of line endings are placed across 16 and 32 byte block edges and the
+// granule edge, where the vector kernels hand over to the scalar code.
+//------------------------------------
+static int test_translate(void)
+{
+    static char text[TEXT_SIZE];
+    static const int edges[] = { 15, 31, 47, 63, 95, 127, DSK_BYTES_PER_GRANULE - 1, 2 * DSK_BYTES_PER_GRANULE - 1 };
+
+    // sparse line endings, so many blocks take the vector path
+    for (int i = 0; i < TEXT_SIZE; i++)
+    {
+        int r = next_random() % 64;
+        text[i] = r == 0 ? 0x0d : r == 1 ? 0x0a : 'a' + r % 26;
+    }
+
+    // a CRLF split across each edge, with an LF run and a lone CR nearby
+    for (int i = 0; i < (int)(sizeof(edges) / sizeof(edges[0])); i++)
+    {
+        int e = edges[i];
+
+        text[e] = 0x0d;
+        text[e + 1] = 0x0a;
+        text[e - 5] = 0x0a;
+        text[e - 4] = 0x0a;
+        text[e + 7] = 0x0d;
+    }
+
+    // ending on a CR leaves it pending at the end of the data
+    text[TEXT_SIZE - 1] = 0x0d;
+
+    DSK_Drive *drv = dsk_new_memory(35, 1);
+    CHECK(drv);
+
+    // from memory, translated in one call
+    CHECK(dsk_write_file_from_buffer(drv, "MEMORY.TXT", text, TEXT_SIZE, DSK_MODE_ASCII, DSK_TYPE_TEXT) == E_OK);
+    CHECK(check_text_file(drv, "MEMORY.TXT", text, TEXT_SIZE) == E_OK);
+
+    // from a host file, translated a granule at a time
+    CHECK(write_host_file("LINES.TXT", text, TEXT_SIZE) == E_OK);
+    int added = dsk_add_file(drv, "LINES.TXT", DSK_MODE_ASCII, DSK_TYPE_TEXT);
+    remove("LINES.TXT");
+    CHECK(added == E_OK);
+    CHECK(check_text_file(drv, "LINES.TXT", text, TEXT_SIZE) == E_OK);
+
+    CHECK(dsk_check(drv, FALSE) == 0);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    return E_OK;
+}
+
+// fill buf with size random bytes
+static void fill_random(char *buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (char)next_random();
+}
+
+// check a binary file holds exactly size bytes of data
+static int check_file(DSK_Drive *drv, const char *filename, const char *data, long size)
+{
+    char *buf = malloc(size + 1);
+    CHECK(buf);
+
+    long n = dsk_read_file_to_buffer(drv, filename, buf, size + 1);
+    int same = n == size && !memcmp(buf, data, size);
+    free(buf);
+
+    if (!same)
+        printf("%s differs.\n", filename);
+
+    return same ? E_OK : E_FAIL;
+}
+
+//------------------------------------
+// defrag makes every file contiguous without changing any file's
+// contents or the free space, and the result survives a remount
+//------------------------------------
+static int test_defrag(void)
+{
+    static char data[12][20 * DSK_BYTES_PER_GRANULE];
+    char filename[] = "DEFRAG.DSK";     // dsk_new upper cases it in place
+    char names[12][16];
+    long sizes[12];
+    DSK_Layout layout;
+
+    // ten six granule files, then two too big for any hole they leave
+    for (int i = 0; i < 12; i++)
+    {
+        sprintf(names[i], "F%d.BIN", i);
+        sizes[i] = i < 10 ? 6 * DSK_BYTES_PER_GRANULE - i * 100 : i == 10 ? 20 * DSK_BYTES_PER_GRANULE : 10 * DSK_BYTES_PER_GRANULE - 50;
+        fill_random(data[i], sizes[i]);
+    }
+
+    DSK_Drive *drv = dsk_new(filename, 35, 1);
+    CHECK(drv);
+
+    for (int i = 0; i < 10; i++)
+        CHECK(dsk_write_file_from_buffer(drv, names[i], data[i], sizes[i], DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+
+    for (int i = 1; i < 10; i += 2)
+        CHECK(dsk_del(drv, names[i]) == E_OK);
+
+    for (int i = 10; i < 12; i++)
+        CHECK(dsk_write_file_from_buffer(drv, names[i], data[i], sizes[i], DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+
+    CHECK(dsk_layout(drv, &layout) == E_OK);
+    CHECK(layout.fragmented_files == 2);
+
+    int free_granules = dsk_free_granules(drv);
+
+    CHECK(dsk_defrag(drv) > 0);
+
+    CHECK(dsk_layout(drv, &layout) == E_OK);
+    CHECK(layout.files == 7);
+    CHECK(layout.fragmented_files == 0);
+    CHECK(layout.free_runs == 1);
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    drv = dsk_mount_drive(filename);
+    CHECK(drv);
+    CHECK(dsk_check(drv, FALSE) == 0);
+
+    // the files left after the deletes
+    for (int i = 0; i < 12; i++)
+    {
+        if (i >= 10 || !(i & 1))
+            CHECK(check_file(drv, names[i], data[i], sizes[i]) == E_OK);
+    }
+
+    // an orphaned granule would be freed, so a damaged disk is refused
+    drv->fat.granule_map[DSK_TOTAL_GRANULES - 1] = 0xC0;
+    CHECK(dsk_defrag(drv) == E_FAIL);
+    CHECK(drv->fat.granule_map[DSK_TOTAL_GRANULES - 1] == 0xC0);
+    CHECK(dsk_check(drv, TRUE) == 1);
+    CHECK(dsk_defrag(drv) == 0);
+    CHECK(dsk_free_granules(drv) == free_granules);
+
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+    remove(filename);
+
+    return E_OK;
+}
+
+// read up to size bytes of a host file, returning the count or E_FAIL
+static long read_host_file(const char *filename, void *buf, size_t size)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return E_FAIL;
+
+    long n = (long)fread(buf, 1, size, fp);
+    fclose(fp);
+
+    return n;
+}
+
+//------------------------------------
+// a bulk add takes exactly the granules its files need, and extract all
+// writes back every file matching the pattern and no others
+//------------------------------------
+static int test_bulk(void)
+{
+    static char data[6][5 * DSK_BYTES_PER_GRANULE], buf[5 * DSK_BYTES_PER_GRANULE + 1], big[60 * DSK_BYTES_PER_GRANULE];
+    static const long sizes[6] = { 1, DSK_BYTES_PER_GRANULE, DSK_BYTES_PER_GRANULE + 1, 10000, 5 * DSK_BYTES_PER_GRANULE - 1, 0 };
+    static const int granules[6] = { 1, 2, 2, 5, 5, 1 };    // the last granule is never full
+    const char *names[6] = { "BULK0.BIN", "BULK1.BIN", "BULK2.BIN", "BULK3.BIN", "BULK4.BIN", "BULK5.BIN" };
+    int needed = 0;
+
+    for (int i = 0; i < 6; i++)
+    {
+        fill_random(data[i], sizes[i]);
+        CHECK(write_host_file(names[i], data[i], sizes[i]) == E_OK);
+        needed += granules[i];
+    }
+
+    DSK_Drive *drv = dsk_new_memory(35, 1);
+    CHECK(drv);
+    CHECK(dsk_write_file_from_buffer(drv, "OTHER.BIN", data[3], sizes[3], DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+
+    int free_granules = dsk_free_granules(drv);
+    int added = dsk_add_files(drv, names, 6, DSK_MODE_BINARY, DSK_TYPE_DATA);
+
+    for (int i = 0; i < 6; i++)
+        remove(names[i]);
+
+    CHECK(added == E_OK);
+    CHECK(dsk_free_granules(drv) == free_granules - needed);
+    CHECK(dsk_check(drv, FALSE) == 0);
+
+    for (int i = 0; i < 6; i++)
+        CHECK(check_file(drv, names[i], data[i], sizes[i]) == E_OK);
+
+    // only the matching files are written
+    CHECK(dsk_extract_all(drv, "BULK*.BIN") == 6);
+    CHECK(read_host_file("OTHER.BIN", buf, sizeof(buf)) == E_FAIL);
+
+    int same = TRUE;
+    for (int i = 0; i < 6; i++)
+    {
+        if (read_host_file(names[i], buf, sizeof(buf)) != sizes[i] || memcmp(buf, data[i], sizes[i]))
+        {
+            printf("%s differs.\n", names[i]);
+            same = FALSE;
+        }
+
+        remove(names[i]);
+    }
+
+    CHECK(same);
+
+    // a bulk add that does not fit changes nothing
+    free_granules = dsk_free_granules(drv);
+    CHECK(write_host_file("BIG.BIN", big, sizeof(big)) == E_OK);
+    CHECK(write_host_file("SMALL.BIN", data[0], sizes[0]) == E_OK);
+
+    const char *too_big[2] = { "SMALL.BIN", "BIG.BIN" };
+    added = dsk_add_files(drv, too_big, 2, DSK_MODE_BINARY, DSK_TYPE_DATA);
+    remove("BIG.BIN");
+    remove("SMALL.BIN");
+
+    CHECK(added == E_FAIL);
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(dsk_file_size(drv, "SMALL.BIN") == E_FAIL);
+    CHECK(dsk_check(drv, FALSE) == 0);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    return E_OK;
+}
+
+// size of a file taking exactly count granules
+#define GRANULES_SIZE(count)    (((count) - 1) * DSK_BYTES_PER_GRANULE + 100)
+
+// first granule of a file, or E_FAIL
+static int first_granule(DSK_Drive *drv, const char *filename)
+{
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        if (!strcmp(drv->dir_names[i], filename))
+            return drv->dirs[i].first_granule;
+    }
+
+    return E_FAIL;
+}
+
+// a new drive with free runs of 3, 5, 4 and 51 granules, in that order
+static DSK_Drive *new_holed_drive(DSK_ALLOC_POLICY policy)
+{
+    static const int granules[6] = { 3, 2, 5, 2, 4, 1 };
+    static char data[GRANULES_SIZE(5)];
+    char name[16];
+
+    DSK_Drive *drv = dsk_new_memory(35, 1);
+    if (!drv || dsk_set_alloc_policy(drv, policy))
+        return NULL;
+
+    for (int i = 0; i < 6; i++)
+    {
+        sprintf(name, "H%d.BIN", i);
+        if (dsk_write_file_from_buffer(drv, name, data, GRANULES_SIZE(granules[i]), DSK_MODE_BINARY, DSK_TYPE_DATA))
+            return NULL;
+    }
+
+    for (int i = 0; i < 6; i += 2)
+    {
+        sprintf(name, "H%d.BIN", i);
+        if (dsk_del(drv, name))
+            return NULL;
+    }
+
+    return drv;
+}
+
+//------------------------------------
+// each allocation policy places a file in one extent in the run it
+// should choose, and a file no run can hold takes the fewest runs
+//------------------------------------
+static int test_alloc(void)
+{
+    static const DSK_ALLOC_POLICY policies[3] = { DSK_ALLOC_FIRST_FIT, DSK_ALLOC_BEST_FIT, DSK_ALLOC_NEXT_FIT };
+    static const int starts[3] = { 5, 12, 17 };
+    static char data[GRANULES_SIZE(55)];
+    DSK_FileLayout layout;
+
+    fill_random(data, sizeof(data));
+
+    for (int i = 0; i < 3; i++)
+    {
+        DSK_Drive *drv = new_holed_drive(policies[i]);
+        CHECK(drv);
+
+        int free_granules = dsk_free_granules(drv);
+        CHECK(free_granules == 63);
+
+        CHECK(dsk_write_file_from_buffer(drv, "FILE.BIN", data, GRANULES_SIZE(4), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+        CHECK(first_granule(drv, "FILE.BIN") == starts[i]);
+        CHECK(dsk_file_layout(drv, "FILE.BIN", &layout) == E_OK);
+        CHECK(layout.granules == 4);
+        CHECK(layout.extents == 1);
+        CHECK(dsk_free_granules(drv) == free_granules - 4);
+        CHECK(check_file(drv, "FILE.BIN", data, GRANULES_SIZE(4)) == E_OK);
+        CHECK(dsk_unmount_drive(drv) == E_OK);
+    }
+
+    // next fit carries on after the last file
+    DSK_Drive *drv = new_holed_drive(DSK_ALLOC_NEXT_FIT);
+    CHECK(drv);
+    CHECK(dsk_write_file_from_buffer(drv, "A.BIN", data, GRANULES_SIZE(2), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_write_file_from_buffer(drv, "B.BIN", data, GRANULES_SIZE(2), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(first_granule(drv, "A.BIN") == 17);
+    CHECK(first_granule(drv, "B.BIN") == 19);
+    CHECK(dsk_set_alloc_policy(drv, (DSK_ALLOC_POLICY)3) == E_FAIL);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    // too big for any run, so it takes the longest two
+    drv = new_holed_drive(DSK_ALLOC_FIRST_FIT);
+    CHECK(drv);
+    CHECK(dsk_write_file_from_buffer(drv, "BIG.BIN", data, GRANULES_SIZE(55), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(first_granule(drv, "BIG.BIN") == 5);
+    CHECK(dsk_file_layout(drv, "BIG.BIN", &layout) == E_OK);
+    CHECK(layout.granules == 55);
+    CHECK(layout.extents == 2);
+    CHECK(dsk_free_granules(drv) == 63 - 55);
+    CHECK(check_file(drv, "BIG.BIN", data, GRANULES_SIZE(55)) == E_OK);
+    CHECK(dsk_check(drv, FALSE) == 0);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    return E_OK;
+}
+
+// write size bytes of data to a new file in uneven pieces
+static int write_pieces(DSK_Drive *drv, const char *filename, const char *data, long size)
+{
+    DSK_File *file = dsk_create(drv, filename, DSK_MODE_BINARY, DSK_TYPE_DATA);
+    CHECK(file);
+
+    for (long pos = 0, n = 1; pos < size; pos += n, n = n * 3 + 7)
+    {
+        if (n > size - pos)
+            n = size - pos;
+
+        CHECK(dsk_write(file, data + pos, n) == n);
+        CHECK(dsk_tell(file) == pos + n);
+    }
+
+    CHECK(dsk_close(file) == E_OK);
+
+    return E_OK;
+}
+
+//------------------------------------
+// files written through DSK_File handles in pieces, with a rewrite in
+// the middle, read back the same through read, seek and pread and take
+// the same granules as a file added in one go
+//------------------------------------
+static int test_file(void)
+{
+    static char data[3 * DSK_BYTES_PER_GRANULE], buf[sizeof(data) + 1], edited[5000];
+    static const long sizes[2] = { 3 * DSK_BYTES_PER_GRANULE, 5000 };
+    const char *names[2] = { "FULL.BIN", "PART.BIN" };
+    char filename[] = "FILE.DSK";       // dsk_new upper cases it in place
+
+    fill_random(data, sizeof(data));
+
+    DSK_Drive *drv = dsk_new(filename, 35, 1);
+    CHECK(drv);
+
+    int free_granules = dsk_free_granules(drv);
+
+    for (int i = 0; i < 2; i++)
+    {
+        CHECK(write_pieces(drv, names[i], data, sizes[i]) == E_OK);
+        free_granules -= sizes[i] / DSK_BYTES_PER_GRANULE + 1;
+        CHECK(dsk_free_granules(drv) == free_granules);
+        CHECK(dsk_file_size(drv, names[i]) == sizes[i]);
+    }
+
+    // rewrite a piece across the first granule edge
+    DSK_File *file = dsk_create(drv, "EDIT.BIN", DSK_MODE_BINARY, DSK_TYPE_DATA);
+    CHECK(file);
+    CHECK(dsk_write(file, buf, sizes[1]) == sizes[1]);
+    CHECK(dsk_seek(file, 0, SEEK_SET) == E_OK);
+    CHECK(dsk_write(file, data, sizes[1]) == sizes[1]);
+    CHECK(dsk_seek(file, DSK_BYTES_PER_GRANULE - 50, SEEK_SET) == E_OK);
+    CHECK(dsk_write(file, data, 100) == 100);
+    CHECK(dsk_pread(file, buf, 200, DSK_BYTES_PER_GRANULE - 100) == 200);
+    CHECK(!memcmp(buf, data + DSK_BYTES_PER_GRANULE - 100, 50));
+    CHECK(!memcmp(buf + 50, data, 100));
+    CHECK(!memcmp(buf + 150, data + DSK_BYTES_PER_GRANULE + 50, 50));
+    CHECK(dsk_tell(file) == DSK_BYTES_PER_GRANULE + 50);
+    CHECK(dsk_seek(file, 0, SEEK_END) == E_OK);
+    CHECK(dsk_tell(file) == sizes[1]);
+    CHECK(dsk_close(file) == E_OK);
+    free_granules -= 3;
+    CHECK(dsk_free_granules(drv) == free_granules);
+
+    // read back in uneven pieces
+    file = dsk_open(drv, "FULL.BIN");
+    CHECK(file);
+
+    long count = 0, n;
+    while ((n = dsk_read(file, buf + count, 333)) > 0)
+        count += n;
+
+    CHECK(n == 0);
+    CHECK(count == sizes[0]);
+    CHECK(!memcmp(buf, data, sizes[0]));
+
+    // seek and pread, which leaves the position alone
+    CHECK(dsk_seek(file, -10, SEEK_END) == E_OK);
+    CHECK(dsk_tell(file) == sizes[0] - 10);
+    CHECK(dsk_pread(file, buf, 100, DSK_BYTES_PER_GRANULE - 50) == 100);
+    CHECK(!memcmp(buf, data + DSK_BYTES_PER_GRANULE - 50, 100));
+    CHECK(dsk_tell(file) == sizes[0] - 10);
+    CHECK(dsk_read(file, buf, 100) == 10);
+    CHECK(!memcmp(buf, data + sizes[0] - 10, 10));
+    CHECK(dsk_pread(file, buf, 1, sizes[0] + 1) == E_FAIL);
+    CHECK(dsk_seek(file, 1, SEEK_END) == E_FAIL);
+    CHECK(dsk_seek(file, -1, SEEK_SET) == E_FAIL);
+    CHECK(dsk_write(file, data, 1) == E_FAIL);
+    CHECK(dsk_close(file) == E_OK);
+
+    CHECK(dsk_create(drv, "FULL.BIN", DSK_MODE_BINARY, DSK_TYPE_DATA) == NULL);
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    memcpy(edited, data, sizeof(edited));
+    memcpy(edited + DSK_BYTES_PER_GRANULE - 50, data, 100);
+
+    drv = dsk_mount_drive(filename);
+    CHECK(drv);
+    CHECK(dsk_check(drv, FALSE) == 0);
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(check_file(drv, "FULL.BIN", data, sizes[0]) == E_OK);
+    CHECK(check_file(drv, "PART.BIN", data, sizes[1]) == E_OK);
+    CHECK(check_file(drv, "EDIT.BIN", edited, sizeof(edited)) == E_OK);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+    remove(filename);
+
+    return E_OK;
+}
+
+// check a DSK file mounted on its own holds one file of size bytes of data
+static int check_image(const char *filename, const char *name, const char *data, long size, int free_granules)
+{
+    DSK_Drive *drv = dsk_mount_drive(filename);
+    CHECK(drv);
+
+    int result = dsk_check(drv, FALSE) || dsk_free_granules(drv) != free_granules || check_file(drv, name, data, size) ? E_FAIL : E_OK;
+
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    return result;
+}
+
+//------------------------------------
+// a pool shares one drive per DSK file, evicts the least recently used
+// idle drive writing its changes, and keeps drives that are in use or
+// in a transaction
+//------------------------------------
+static int test_pool(void)
+{
+    static char data[5000];
+    char filenames[3][16];
+
+    fill_random(data, sizeof(data));
+
+    for (int i = 0; i < 3; i++)
+    {
+        sprintf(filenames[i], "POOL%d.DSK", i);
+
+        DSK_Drive *drv = dsk_new(filenames[i], 35, 1);
+        CHECK(drv);
+        CHECK(dsk_unmount_drive(drv) == E_OK);
+    }
+
+    DSK_Pool *pool = dsk_pool_new(2, 0);
+    CHECK(pool);
+
+    // one drive, whatever the path
+    DSK_Drive *drv0 = dsk_pool_get(pool, "POOL0.DSK");
+    CHECK(drv0);
+    CHECK(dsk_pool_get(pool, "./POOL0.DSK") == drv0);
+    CHECK(dsk_pool_release(pool, drv0) == E_OK);
+
+    int free_granules = dsk_free_granules(drv0);
+    CHECK(dsk_write_file_from_buffer(drv0, "A.BIN", data, sizeof(data), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_pool_release(pool, drv0) == E_OK);
+
+    // POOL0 is idle and oldest, so it is evicted and written
+    DSK_Drive *drv1 = dsk_pool_get(pool, "POOL1.DSK");
+    CHECK(drv1);
+    DSK_Drive *drv2 = dsk_pool_get(pool, "POOL2.DSK");
+    CHECK(drv2);
+    CHECK(check_image("POOL0.DSK", "A.BIN", data, sizeof(data), free_granules - 3) == E_OK);
+
+    // both slots are in use
+    CHECK(dsk_pool_get(pool, "POOL0.DSK") == NULL);
+    CHECK(dsk_pool_evict(pool, "POOL1.DSK") == E_FAIL);
+    CHECK(dsk_pool_release(pool, drv1) == E_OK);
+    CHECK(dsk_pool_evict(pool, "POOL1.DSK") == E_OK);
+
+    drv0 = dsk_pool_get(pool, "POOL0.DSK");
+    CHECK(drv0);
+    CHECK(dsk_free_granules(drv0) == free_granules - 3);
+    CHECK(check_file(drv0, "A.BIN", data, sizeof(data)) == E_OK);
+
+    // POOL0 is now the oldest, but is kept while in a transaction
+    CHECK(dsk_begin(drv0) == E_OK);
+    CHECK(dsk_write_file_from_buffer(drv0, "B.BIN", data, sizeof(data), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_pool_release(pool, drv0) == E_OK);
+    CHECK(dsk_pool_release(pool, drv2) == E_OK);
+    CHECK(dsk_pool_get(pool, "POOL2.DSK") == drv2);
+    CHECK(dsk_pool_release(pool, drv2) == E_OK);
+
+    drv1 = dsk_pool_get(pool, "POOL1.DSK");
+    CHECK(drv1);
+    CHECK(dsk_pool_get(pool, "POOL0.DSK") == drv0);
+    CHECK(dsk_commit(drv0) == E_OK);
+    CHECK(dsk_free_granules(drv0) == free_granules - 6);
+    CHECK(dsk_pool_release(pool, drv0) == E_OK);
+    CHECK(dsk_pool_release(pool, drv1) == E_OK);
+
+    CHECK(dsk_pool_flush(pool) == E_OK);
+    CHECK(dsk_pool_free(pool) == E_OK);
+
+    CHECK(check_image("POOL0.DSK", "B.BIN", data, sizeof(data), free_granules - 6) == E_OK);
+
+    for (int i = 0; i < 3; i++)
+        remove(filenames[i]);
+
+    return E_OK;
+}
+
+//------------------------------------
+// images with more tracks than a drive holds are refused rather than
+// overrunning the FAT and free map, and the largest one accepted can
+// be filled to the last granule
+//------------------------------------
+static int test_geometry(void)
+{
+    static char data[(DSK_MAX_TRACKS - 1) * DSK_GRANULES_PER_TRACK * DSK_BYTES_PER_GRANULE];
+    char filename[] = "GEOMETRY.DSK";   // dsk_new upper cases it in place
+
+    // 80 tracks on each of two sides
+    remove(filename);
+    CHECK(dsk_new(filename, DSK_MAX_TRACKS, 2) == NULL);
+    CHECK(read_host_file(filename, data, 1) == E_FAIL);
+    CHECK(dsk_new_memory(DSK_MAX_TRACKS, 2) == NULL);
+
+    memset(data, 0, sizeof(data));
+    FILE *fp = fopen(filename, "wb");
+    CHECK(fp);
+    for (int i = 0; i < 2 * DSK_MAX_TRACKS; i++)
+        CHECK(fwrite(data, DSK_BYTES_DATA_PER_TRACK, 1, fp) == 1);
+    CHECK(fclose(fp) == 0);
+
+    CHECK(dsk_mount_drive(filename) == NULL);
+    CHECK(dsk_handle_open(filename, 0, 0) == NULL);
+
+    // a drive claiming that many is reported by the check, not overrun
+    DSK_Drive *drv = dsk_new_memory(DSK_MAX_TRACKS, 1);
+    CHECK(drv);
+    drv->num_tracks = 2 * DSK_MAX_TRACKS;
+    int problems = dsk_check(drv, FALSE);
+    drv->num_tracks = DSK_MAX_TRACKS;
+    CHECK(problems == 1);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    // 80 tracks on one side
+    drv = dsk_new(filename, DSK_MAX_TRACKS, 1);
+    CHECK(drv);
+
+    int granules = (DSK_MAX_TRACKS - 1) * DSK_GRANULES_PER_TRACK;
+    long size = (long)(granules - 1) * DSK_BYTES_PER_GRANULE + 100;
+
+    fill_random(data, size);
+    CHECK(dsk_free_granules(drv) == granules);
+    CHECK(dsk_write_file_from_buffer(drv, "ALL.BIN", data, size, DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_free_granules(drv) == 0);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    drv = dsk_mount_drive(filename);
+    CHECK(drv);
+    CHECK(dsk_check(drv, FALSE) == 0);
+    CHECK(dsk_free_granules(drv) == 0);
+    CHECK(check_file(drv, "ALL.BIN", data, size) == E_OK);
+    CHECK(dsk_del(drv, "ALL.BIN") == E_OK);
+    CHECK(dsk_free_granules(drv) == granules);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+    remove(filename);
+
+    return E_OK;
+}
+
+//------------------------------------
+// a drive from a handle is read only, every change to it fails without
+// touching the DSK file
+//------------------------------------
+static int test_read_only(void)
+{
+    static char data[5000], before[35 * DSK_BYTES_DATA_PER_TRACK], after[sizeof(before) + 1];
+    char filename[] = "READONLY.DSK";   // dsk_new upper cases it in place
+    const char *names[1] = { "NEW.BIN" };
+    char old_name[] = "OLD.BIN", new_name[] = "NEW.BIN";  // dsk_rename upper cases them in place
+
+    fill_random(data, sizeof(data));
+    CHECK(write_host_file("NEW.BIN", data, sizeof(data)) == E_OK);
+
+    DSK_Drive *drv = dsk_new(filename, 35, 1);
+    CHECK(drv);
+    CHECK(dsk_write_file_from_buffer(drv, "OLD.BIN", data, sizeof(data), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+    CHECK(read_host_file(filename, before, sizeof(before)) == sizeof(before));
+
+    DSK_Handle *h = dsk_handle_open(filename, 0, 0);
+    CHECK(h);
+    drv = dsk_handle_drive(h);
+    CHECK(drv);
+
+    int free_granules = dsk_free_granules(drv);
+
+    CHECK(dsk_add_files(drv, names, 1, DSK_MODE_BINARY, DSK_TYPE_DATA) == E_FAIL);
+    CHECK(dsk_add_file(drv, "NEW.BIN", DSK_MODE_BINARY, DSK_TYPE_DATA) == E_FAIL);
+    CHECK(dsk_write_file_from_buffer(drv, "MEM.BIN", data, sizeof(data), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_FAIL);
+    CHECK(dsk_create(drv, "NEW.BIN", DSK_MODE_BINARY, DSK_TYPE_DATA) == NULL);
+    CHECK(dsk_del(drv, "OLD.BIN") == E_FAIL);
+    CHECK(dsk_rename(drv, old_name, new_name) == E_FAIL);
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(check_file(drv, "OLD.BIN", data, sizeof(data)) == E_OK);
+    CHECK(dsk_handle_close(h) == E_OK);
+    remove("NEW.BIN");
+
+    CHECK(read_host_file(filename, after, sizeof(after)) == sizeof(before));
+    CHECK(!memcmp(before, after, sizeof(before)));
+    remove(filename);
+
+    return E_OK;
+}
+
+// read the FAT and directory sectors of a DSK file as they are on disk
+static int read_metadata(const char *filename, char *buf)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return E_FAIL;
+
+    int result = fseek(fp, DSK_OFFSET(DSK_DIR_TRACK, DSK_FAT_SECTOR), SEEK_SET) ||
+        fread(buf, DSK_METADATA_SECTORS * DSK_BYTES_DATA_PER_SECTOR, 1, fp) != 1 ? E_FAIL : E_OK;
+
+    fclose(fp);
+
+    return result;
+}
+
+//------------------------------------
+// a rolled back add and kill leave the FAT and directory as they were,
+// on the DSK and in memory, while a committed one is written and stays
+//------------------------------------
+static int test_transaction(void)
+{
+    static char a[5000], b[3 * DSK_BYTES_PER_GRANULE], c[6000];
+    static char before[DSK_METADATA_SECTORS * DSK_BYTES_DATA_PER_SECTOR], after[sizeof(before)];
+    char filename[] = "TXN.DSK";        // dsk_new upper cases it in place
+
+    fill_random(a, sizeof(a));
+    fill_random(b, sizeof(b));
+    fill_random(c, sizeof(c));
+
+    DSK_Drive *drv = dsk_new(filename, 35, 1);
+    CHECK(drv);
+    CHECK(dsk_write_file_from_buffer(drv, "A.BIN", a, sizeof(a), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_write_file_from_buffer(drv, "B.BIN", b, sizeof(b), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+
+    CHECK(read_metadata(filename, before) == E_OK);
+    int free_granules = dsk_free_granules(drv);
+
+    // rolled back, C must not be written over the granules A had
+    CHECK(dsk_begin(drv) == E_OK);
+    CHECK(dsk_del(drv, "A.BIN") == E_OK);
+    CHECK(dsk_write_file_from_buffer(drv, "C.BIN", c, sizeof(c), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_flush(drv) == E_OK);
+
+    CHECK(read_metadata(filename, after) == E_OK);
+    CHECK(!memcmp(before, after, sizeof(before)));
+
+    CHECK(dsk_rollback(drv) == E_OK);
+
+    CHECK(read_metadata(filename, after) == E_OK);
+    CHECK(!memcmp(before, after, sizeof(before)));
+    CHECK(!memcmp(drv->fat.granule_map, before, DSK_BYTES_DATA_PER_SECTOR));
+    CHECK(!memcmp(drv->dirs, before + DSK_BYTES_DATA_PER_SECTOR, sizeof(drv->dirs)));
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(check_file(drv, "A.BIN", a, sizeof(a)) == E_OK);
+    CHECK(dsk_check(drv, FALSE) == 0);
+
+    // committed
+    CHECK(dsk_begin(drv) == E_OK);
+    CHECK(dsk_write_file_from_buffer(drv, "C.BIN", c, sizeof(c), DSK_MODE_BINARY, DSK_TYPE_DATA) == E_OK);
+    CHECK(dsk_del(drv, "A.BIN") == E_OK);
+    CHECK(dsk_commit(drv) == E_OK);
+
+    CHECK(read_metadata(filename, after) == E_OK);
+    CHECK(!memcmp(drv->fat.granule_map, after, DSK_BYTES_DATA_PER_SECTOR));
+    CHECK(!memcmp(drv->dirs, after + DSK_BYTES_DATA_PER_SECTOR, sizeof(drv->dirs)));
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+
+    drv = dsk_mount_drive(filename);
+    CHECK(drv);
+    CHECK(dsk_check(drv, FALSE) == 0);
+    CHECK(dsk_free_granules(drv) == free_granules);
+    CHECK(check_file(drv, "B.BIN", b, sizeof(b)) == E_OK);
+    CHECK(check_file(drv, "C.BIN", c, sizeof(c)) == E_OK);
+    CHECK(dsk_unmount_drive(drv) == E_OK);
+    remove(filename);
+
+    return E_OK;
+}
+
+//
+static const Test tests[] =
+{
+    { "alloc", test_alloc },
+    { "bulk", test_bulk },
+    { "defrag", test_defrag },
+    { "file", test_file },
+    { "geometry", test_geometry },
+    { "pool", test_pool },
+    { "read_only", test_read_only },
+    { "transaction", test_transaction },
+    { "translate", test_translate },
+};
+
+//
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        puts("usage: dsk_test test");
+        exit(E_FAIL);
+    }
+
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++)
+    {
+        if (!strcmp(argv[1], tests[i].name))
+            return tests[i].fn();
+    }
+
+    printf("error: unknown test %s\n", argv[1]);
+
+    return E_FAIL;
+}
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "dsk.h"
+#include "dsktoolsd.h"
+
+//
+// dsktoolsd keeps DSK images mounted in a drive pool and serves
+// requests from dsktools -s over a Unix domain socket, one thread per
+// connection up to a limit. Requests for different images run
+// concurrently, requests for the same image are ordered by its drive
+// lock. SIGINT and SIGTERM flush the pool before exiting.
+//
+// Images should only be changed through dsktoolsd while it has them
+// mounted.
+//
+
+#define MAX_REQUEST_ARGS    4
+#define DEFAULT_THREADS     32
+#define SOCKET_NAME         "dsktoolsd.sock"
+
+//
+typedef struct
+{
+    char *text;
+    size_t used, size;
+} TextBuffer;
+
+static DSK_Pool *g_pool;
+static char g_socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static __thread TextBuffer *t_output;
+
+// connection threads, at most g_max_threads
+static pthread_mutex_t g_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_thread_done = PTHREAD_COND_INITIALIZER;
+static int g_threads, g_max_threads = DEFAULT_THREADS;
+
+// library output is sent back with the reply
+static void capture_output(const char *s)
+{
+    TextBuffer *out = t_output;
+    size_t len = strlen(s);
+
+    if (!out)
+        return;
+
+    if (out->used + len + 1 > out->size)
+    {
+        size_t size = (out->used + len + 1) * 2;
+        char *text = realloc(out->text, size);
+        if (!text)
+            return;
+
+        out->text = text;
+        out->size = size;
+    }
+
+    memcpy(out->text + out->used, s, len + 1);
+    out->used += len;
+}
+
+//
+static void printf_output(const char *format, ...)
+{
+    char buf[DSK_PRINTF_BUF_SIZE];
+    va_list valist;
+
+    va_start(valist, format);
+    vsnprintf(buf, sizeof(buf), format, valist);
+    va_end(valist);
+
+    capture_output(buf);
+}
+
+// append extracted data to a TextBuffer
+static int buffer_sink(void *ctx, const void *data, size_t size)
+{
+    TextBuffer *buf = ctx;
+
+    if (buf->used + size > buf->size)
+    {
+        size_t new_size = (buf->used + size) * 2;
+        char *text = realloc(buf->text, new_size);
+        if (!text)
+        {
+            capture_output("out of memory.\n");
+            return E_FAIL;
+        }
+
+        buf->text = text;
+        buf->size = new_size;
+    }
+
+    memcpy(buf->text + buf->used, data, size);
+    buf->used += size;
+
+    return E_OK;
+}
+
+// extract a file into a new buffer, reading it once
+static char *extract(DSK_Drive *drv, const char *filename, long *size)
+{
+    TextBuffer buf = { NULL, 0, 0 };
+
+    if (dsk_extract_to_sink(drv, filename, buffer_sink, &buf))
+    {
+        free(buf.text);
+        return NULL;
+    }
+
+    *size = buf.used;
+
+    // an empty file still returns a buffer
+    return buf.text ? buf.text : malloc(1);
+}
+
+// parse a file type sent by a client, E_FAIL if not a DSK_FILE_TYPE
+static int parse_type(const char *s, DSK_FILE_TYPE *type)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if (!*s || *end || n < DSK_TYPE_BASIC || n > DSK_TYPE_TEXT)
+    {
+        capture_output("invalid file type.\n");
+        return E_FAIL;
+    }
+
+    *type = (DSK_FILE_TYPE)n;
+
+    return E_OK;
+}
+
+// run one request, returning E_OK or E_FAIL
+static int serve_request(uint32_t op, char **args, int count, const char *data, uint32_t data_size, char **reply, long *reply_size)
+{
+    DSK_Drive *drv = dsk_pool_get(g_pool, args[0]);
+    if (!drv)
+        return E_FAIL;
+
+    DSK_FILE_TYPE type;
+    int result = E_FAIL;
+
+    switch (op)
+    {
+    case DSKD_DIR:
+        result = dsk_dir(drv);
+        break;
+
+    case DSKD_ADD:
+        if (count == 4 && !parse_type(args[3], &type))
+        {
+            DSK_OPEN_MODE mode = args[2][0] == 'A' ? DSK_MODE_ASCII : DSK_MODE_BINARY;
+            result = dsk_write_file_from_buffer(drv, args[1], data, data_size, mode, type);
+        }
+        break;
+
+    case DSKD_EXTRACT:
+        if (count == 2)
+        {
+            *reply = extract(drv, args[1], reply_size);
+            result = *reply ? E_OK : E_FAIL;
+        }
+        break;
+
+    case DSKD_DEL:
+        if (count == 2)
+            result = dsk_del(drv, args[1]);
+        break;
+
+    case DSKD_RENAME:
+        if (count == 3)
+            result = dsk_rename(drv, args[1], args[2]);
+        break;
+
+    case DSKD_FREE:
+        printf_output("\n%d bytes (%d granules) free.\n", dsk_free_bytes(drv), dsk_free_granules(drv));
+        result = E_OK;
+        break;
+
+    case DSKD_GRANS:
+        result = dsk_granule_map(drv);
+        break;
+
+    case DSKD_FLUSH:
+        result = dsk_flush(drv);
+        break;
+
+    default:
+        capture_output("unknown request.\n");
+        break;
+    }
+
+    dsk_pool_release(g_pool, drv);
+
+    return result;
+}
+
+// serve requests on one connection until it closes
+static void *connection(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    TextBuffer out = { NULL, 0, 0 };
+    DSKD_Header h;
+
+    t_output = &out;
+
+    while (!dskd_read_header(fd, &h))
+    {
+        if (h.args_size == 0 || h.args_size > DSKD_MAX_ARGS || h.data_size > DSKD_MAX_DATA)
+            break;
+
+        char *args_buf = malloc(h.args_size + 1);
+        char *data = malloc(h.data_size ? h.data_size : 1);
+
+        if (!args_buf || !data || dskd_read(fd, args_buf, h.args_size) || dskd_read(fd, data, h.data_size))
+        {
+            free(args_buf);
+            free(data);
+            break;
+        }
+
+        // split the NUL separated args
+        char *args[MAX_REQUEST_ARGS];
+        int count = 0;
+
+        args_buf[h.args_size] = 0;
+        for (char *p = args_buf; p < args_buf + h.args_size && count < MAX_REQUEST_ARGS; p += strlen(p) + 1)
+            args[count++] = p;
+
+        char *reply = NULL;
+        long reply_size = 0;
+
+        out.used = 0;
+        if (out.text)
+            out.text[0] = 0;
+
+        int result = serve_request(h.op, args, count, data, h.data_size, &reply, &reply_size);
+        int sent = dskd_send(fd, (uint32_t)result, out.text, (uint32_t)out.used, reply, (uint32_t)reply_size);
+
+        free(reply);
+        free(args_buf);
+        free(data);
+
+        if (sent)
+            break;
+    }
+
+    close(fd);
+    free(out.text);
+
+    pthread_mutex_lock(&g_thread_lock);
+    g_threads--;
+    pthread_cond_signal(&g_thread_done);
+    pthread_mutex_unlock(&g_thread_lock);
+
+    return NULL;
+}
+
+// accept connections, waiting for a thread to finish when at the limit
+static void *listener(void *arg)
+{
+    int server = (int)(intptr_t)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&g_thread_lock);
+        while (g_threads >= g_max_threads)
+            pthread_cond_wait(&g_thread_done, &g_thread_lock);
+        pthread_mutex_unlock(&g_thread_lock);
+
+        int fd = accept(server, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        pthread_mutex_lock(&g_thread_lock);
+        g_threads++;
+        pthread_mutex_unlock(&g_thread_lock);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection, (void *)(intptr_t)fd))
+        {
+            close(fd);
+
+            pthread_mutex_lock(&g_thread_lock);
+            g_threads--;
+            pthread_mutex_unlock(&g_thread_lock);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+// use $XDG_RUNTIME_DIR, else a directory in /tmp only we can use
+static int default_socket_path(char *path, size_t size)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char tmp_dir[64];
+
+    if (!dir || !dir[0])
+    {
+        struct stat st;
+
+        snprintf(tmp_dir, sizeof(tmp_dir), "/tmp/dsktoolsd-%u", (unsigned)getuid());
+        if (mkdir(tmp_dir, 0700) && errno != EEXIST)
+        {
+            printf("error: cannot create %s\n", tmp_dir);
+            return E_FAIL;
+        }
+
+        // refuse a directory someone else made or can write to
+        if (lstat(tmp_dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+        {
+            printf("error: %s is not a private directory\n", tmp_dir);
+            return E_FAIL;
+        }
+
+        dir = tmp_dir;
+    }
+
+    if ((size_t)snprintf(path, size, "%s/" SOCKET_NAME, dir) >= size)
+    {
+        puts("error: socket path too long");
+        return E_FAIL;
+    }
+
+    return E_OK;
+}
+
+//
+int main(int argc, char *argv[])
+{
+    const char *socket_path = NULL;
+    int images = 64;
+
+    for (int arg = 1; arg < argc; arg += 2)
+    {
+        if (arg + 1 < argc && !strcmp(argv[arg], "-s"))
+            socket_path = argv[arg + 1];
+        else if (arg + 1 < argc && !strcmp(argv[arg], "-n"))
+            images = atoi(argv[arg + 1]);
+        else if (arg + 1 < argc && !strcmp(argv[arg], "-t"))
+            g_max_threads = atoi(argv[arg + 1]) > 0 ? atoi(argv[arg + 1]) : 1;
+        else
+        {
+            puts("usage: dsktoolsd [-s socket] [-n images] [-t threads]");
+            exit(E_FAIL);
+        }
+    }
+
+    if (!socket_path && default_socket_path(g_socket_path, sizeof(g_socket_path)))
+        exit(E_FAIL);
+
+    if (socket_path && (size_t)snprintf(g_socket_path, sizeof(g_socket_path), "%s", socket_path) >= sizeof(g_socket_path))
+    {
+        puts("error: socket path too long");
+        exit(E_FAIL);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, g_socket_path);
+
+    g_pool = dsk_pool_new(images, DSK_MOUNT_MMAP);
+    if (!g_pool)
+        exit(E_FAIL);
+
+    dsk_set_output_function(capture_output);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(g_socket_path);
+
+    if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) || listen(server, 64))
+    {
+        printf("error: unable to listen on %s\n", g_socket_path);
+        exit(E_FAIL);
+    }
+
+    // every thread inherits the blocked signals, main waits for them
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, listener, (void *)(intptr_t)server))
+    {
+        puts("error: unable to start listener");
+        exit(E_FAIL);
+    }
+
+    printf("dsktoolsd v%s listening on %s\n", DSK_VERSION_STRING, g_socket_path);
+    fflush(stdout);
+
+    int sig;
+    while (sigwait(&stop_signals, &sig))
+        ;
+
+    // drives that fell back to stdio still hold FAT and directory changes
+    unlink(g_socket_path);
+    int result = dsk_pool_flush(g_pool);
+
+    return result;
+}
@@ -0,0 +1,100 @@
+#ifndef __DSKTOOLSD_H
+#define __DSKTOOLSD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include "dsk.h"
+
+//
+// dsktoolsd protocol
+//
+// A request is a header, then args_size bytes of NUL terminated strings
+// starting with the full path of the DSK, then data_size bytes of file
+// data. The reply header carries the result in op, the size of the
+// library output in args_size and the size of any file data. Header
+// fields are in network byte order.
+//
+#define DSKD_MAX_ARGS           (4 * FILENAME_MAX)
+#define DSKD_MAX_DATA           (1024 * 1024)
+
+typedef enum
+{
+    DSKD_DIR = 1,
+    DSKD_ADD,                       // name, A|B, type
+    DSKD_EXTRACT,                   // name
+    DSKD_DEL,                       // name
+    DSKD_RENAME,                    // name, new name
+    DSKD_FREE,
+    DSKD_GRANS,
+    DSKD_FLUSH
+} DSKD_OP;
+
+typedef struct
+{
+    uint32_t op;                    // DSKD_OP, or the result in replies
+    uint32_t args_size;             // args, or output text in replies
+    uint32_t data_size;
+} DSKD_Header;
+
+// read exactly size bytes, E_FAIL on error or end of stream
+static inline int dskd_read(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+
+    while (size)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return E_FAIL;
+
+        p += n;
+        size -= n;
+    }
+
+    return E_OK;
+}
+
+// read a header, converting it to host byte order
+static inline int dskd_read_header(int fd, DSKD_Header *h)
+{
+    if (dskd_read(fd, h, sizeof(DSKD_Header)))
+        return E_FAIL;
+
+    h->op = ntohl(h->op);
+    h->args_size = ntohl(h->args_size);
+    h->data_size = ntohl(h->data_size);
+
+    return E_OK;
+}
+
+// send a header, args and data in one write where possible
+static inline int dskd_send(int fd, uint32_t op, const void *args, uint32_t args_size, const void *data, uint32_t data_size)
+{
+    DSKD_Header h = { htonl(op), htonl(args_size), htonl(data_size) };
+    struct iovec iov[3] = { { &h, sizeof(h) }, { (void *)args, args_size }, { (void *)data, data_size } };
+    int first = 0;
+
+    while (first < 3)
+    {
+        ssize_t n = writev(fd, iov + first, 3 - first);
+        if (n < 0)
+            return E_FAIL;
+
+        // skip what was written
+        for (; first < 3 && (size_t)n >= iov[first].iov_len; first++)
+            n -= iov[first].iov_len;
+
+        if (first < 3)
+        {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+
+    return E_OK;
+}
+
+#endif  // __DSKTOOLSD_H
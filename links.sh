@@ -10,3 +10,6 @@ ln -sf "$DSKPATH/dsktools" dsktools
 ln -sf "$DSKPATH/dsk_new" dsk_new
 ln -sf "$DSKPATH/dsk_add" dsk_add
 ln -sf "$DSKPATH/dsk_del" dsk_del
+ln -sf "$DSKPATH/dsk_check" dsk_check
+ln -sf "$DSKPATH/dsk_scan" dsk_scan
+ln -sf "$DSKPATH/dsktoolsd" dsktoolsd
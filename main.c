@@ -5,7 +5,20 @@
 #include <ctype.h>
 #include "dsk.h"
 
+#ifdef _WIN32
+#   include <io.h>
+#   define isatty _isatty
+#   define fileno _fileno
+#else
+#   include <unistd.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include "dsktoolsd.h"
+#   define DSK_HAVE_DAEMON
+#endif
+
 #define SMALL_BUFFER    256
+#define LINE_BUFFER     1024
 
 typedef int (*cmd_func_t)(DSK_Drive *drv, void *params);
 
@@ -27,7 +40,84 @@ typedef struct
 //---------------------------------
 int done = FALSE;
 DSK_Drive *g_drv = NULL;
+DSK_Pool *g_pool = NULL;
+int g_pooled = FALSE;       // TRUE if g_drv came from g_pool
+int g_batch = FALSE;        // TRUE when running -c, -f or piped commands
 Command cmds[];
+Command *g_cmds = cmds;     // remote_cmds when talking to dsktoolsd
+
+//---------------------------------
+// in batch mode each drive's changes are held in a transaction, so
+// the FAT and directory are written once, at the end or on flush
+//---------------------------------
+void set_drive(DSK_Drive *drv, int pooled)
+{
+    g_drv = drv;
+    g_pooled = pooled;
+
+    if (g_drv && g_batch)
+        dsk_begin(g_drv);
+}
+
+//---------------------------------
+// write out changes held for the current drive, and keep holding
+//---------------------------------
+int flush_drive()
+{
+    if (!g_drv)
+        return TRUE;
+
+    if (!g_drv->in_transaction)
+        return dsk_flush(g_drv) == E_OK;
+
+    if (dsk_commit(g_drv))
+        return FALSE;
+
+    if (g_batch)
+        return dsk_begin(g_drv) == E_OK;
+
+    return TRUE;
+}
+
+//---------------------------------
+// let go of the current drive, pooled drives stay mounted for reuse
+//---------------------------------
+void release_drive()
+{
+    if (!g_drv)
+        return;
+
+    if (g_batch && g_drv->in_transaction)
+        dsk_commit(g_drv);
+
+    if (g_pooled)
+        dsk_pool_release(g_pool, g_drv);
+    else
+        dsk_unmount_drive(g_drv);
+
+    g_drv = NULL;
+    g_pooled = FALSE;
+}
+
+//---------------------------------
+// switch to filename, remounting only if it has left the pool
+//---------------------------------
+DSK_Drive *mount_drive(const char *filename)
+{
+    release_drive();
+
+    DSK_Drive *drv = dsk_pool_get(g_pool, filename);
+    if (!drv)
+        return NULL;
+
+    // mapped images have no cache
+    if (!drv->cache)
+        dsk_set_cache_size(drv, DSK_DEFAULT_CACHE_TRACKS);
+
+    set_drive(drv, TRUE);
+
+    return g_drv;
+}
 
 //---------------------------------
 // quit the program
@@ -43,8 +133,7 @@ int quit_fn(DSK_Drive *drv, void *params)
 //---------------------------------
 int dir_fn(DSK_Drive *drv, void *params)
 {
-    dsk_dir(drv);
-    return TRUE;
+    return dsk_dir(drv) == E_OK;
 }
 
 //---------------------------------
@@ -59,12 +148,7 @@ int mount_fn(DSK_Drive *drv, void *params)
         return FALSE;
     }
 
-    // unmount any already mounted drive
-    if (g_drv)
-        dsk_unmount_drive(g_drv);
-
-    g_drv = dsk_mount_drive(filename);
-    if (!g_drv)
+    if (!mount_drive(filename))
     {
         // printf("unable to mount (%s)\n", filename);
         return FALSE;
@@ -78,8 +162,18 @@ int mount_fn(DSK_Drive *drv, void *params)
 //---------------------------------
 int unmount_fn(DSK_Drive *drv, void *params)
 {
-    dsk_unmount_drive(drv);
-    g_drv = NULL;
+    char filename[FILENAME_MAX];
+    int pooled = g_pooled;
+
+    if (!drv)
+        return FALSE;
+
+    strcpy(filename, drv->filename);
+    release_drive();
+
+    // really unmount, rather than keep it in the pool
+    if (pooled)
+        return dsk_pool_evict(g_pool, filename) == E_OK;
 
     return TRUE;
 }
@@ -98,7 +192,7 @@ int gran_map_fn(DSK_Drive *drv, void *params)
 //---------------------------------
 int help_fn(DSK_Drive *drv, void *params)
 {
-    Command *pcmd = cmds;
+    Command *pcmd = g_cmds;
 
     for(; pcmd->cmd; pcmd++)
     {
@@ -120,37 +214,45 @@ int free_fn(DSK_Drive *drv, void *params)
 }
 
 //---------------------------------
-// add a file to the DSK
+// parse the optional file mode and type of add
 //---------------------------------
-int add_fn(DSK_Drive *drv, void *params)
+void parse_mode_type(DSK_OPEN_MODE *mode, DSK_FILE_TYPE *type)
 {
-    char* filename = strtok(NULL, " \n");
-    if (!filename)
-    {
-        puts("missing filename.");
-        return FALSE;
-    }
-
-    // look for optional file mode and type
     char *pmode = strtok(NULL, " \n");
-    DSK_OPEN_MODE mode = DSK_MODE_BINARY;
+    *mode = DSK_MODE_BINARY;
     if (pmode && toupper(pmode[0]) == 'A')
-        mode = DSK_MODE_ASCII;
+        *mode = DSK_MODE_ASCII;
 
     char *ptype = strtok(NULL, " \n");
-    DSK_FILE_TYPE type = DSK_TYPE_ML;
+    *type = DSK_TYPE_ML;
     if (ptype)
     {
         if (toupper(ptype[0]) == 'B')
-            type = DSK_TYPE_BASIC;
+            *type = DSK_TYPE_BASIC;
         else if (toupper(ptype[0]) == 'D')
-            type = DSK_TYPE_DATA;
+            *type = DSK_TYPE_DATA;
         else if (toupper(ptype[0]) == 'T')
-            type = DSK_TYPE_TEXT;
+            *type = DSK_TYPE_TEXT;
     }
+}
 
-    dsk_add_file(drv, filename, mode, type);
-    return TRUE;
+//---------------------------------
+// add a file to the DSK
+//---------------------------------
+int add_fn(DSK_Drive *drv, void *params)
+{
+    char* filename = strtok(NULL, " \n");
+    if (!filename)
+    {
+        puts("missing filename.");
+        return FALSE;
+    }
+
+    DSK_OPEN_MODE mode;
+    DSK_FILE_TYPE type;
+    parse_mode_type(&mode, &type);
+
+    return dsk_add_file(drv, filename, mode, type) == E_OK;
 }
 
 //---------------------------------
@@ -165,8 +267,11 @@ int extract_fn(DSK_Drive *drv, void *params)
         return FALSE;
     }
 
-    dsk_extract_file(drv, filename);
-    return TRUE;
+    // wildcards extract every matching file in one pass
+    if (strpbrk(filename, "*?"))
+        return dsk_extract_all(drv, filename) >= 0;
+
+    return dsk_extract_file(drv, filename) == E_OK;
 }
 
 //---------------------------------
@@ -200,21 +305,138 @@ int new_fn(DSK_Drive *drv, void *params)
         if (sides > DSK_MAX_SIDES) sides = DSK_MAX_SIDES;
     }
 
+    // unmount current DSK if present, and any pooled copy of the file
+    release_drive();
+    if (dsk_pool_evict(g_pool, filename))
+        return FALSE;
+
+    DSK_Drive *new_drv = dsk_new(filename, tracks, sides);
+    if (!new_drv)
+        return FALSE;
+
+    dsk_set_cache_size(new_drv, DSK_DEFAULT_CACHE_TRACKS);
+    set_drive(new_drv, FALSE);
+
+    return TRUE;
+}
+
+//---------------------------------
+// create a new DSK in memory
+//---------------------------------
+int ram_fn(DSK_Drive *drv, void *params)
+{
+    int tracks = 35;
+
+    char *ptracks = strtok(NULL, " \n");
+    if (ptracks)
+    {
+        tracks = atoi(ptracks);
+        if (tracks < DSK_MIN_TRACKS) tracks = DSK_MIN_TRACKS;
+        if (tracks > DSK_MAX_TRACKS) tracks = DSK_MAX_TRACKS;
+    }
+
     // unmount current DSK if present
-    if (drv)
-        dsk_unmount_drive(drv);
+    release_drive();
 
-    g_drv = dsk_new(filename, tracks, sides);
+    DSK_Drive *new_drv = dsk_new_memory(tracks, 1);
+    if (!new_drv)
+        return FALSE;
+
+    set_drive(new_drv, FALSE);
 
     return TRUE;
 }
 
+//---------------------------------
+// write the mounted DSK to a file
+//---------------------------------
+int save_fn(DSK_Drive *drv, void *params)
+{
+    char *filename = strtok(NULL, " \n");
+
+    // a pooled copy of the file would go stale
+    if (filename && dsk_pool_evict(g_pool, filename))
+        return FALSE;
+
+    return dsk_save(drv, filename) == E_OK;
+}
+
 //---------------------------------
 // format the mounted DSK file
 //---------------------------------
 int format_fn(DSK_Drive *drv, void *params)
 {
-    dsk_format(drv);
+    return dsk_format(drv) == E_OK;
+}
+
+//---------------------------------
+// make every file on the DSK contiguous
+//---------------------------------
+int defrag_fn(DSK_Drive *drv, void *params)
+{
+    // defrag cannot run inside the batch transaction
+    if (g_batch && drv && drv->in_transaction && dsk_commit(drv))
+        return FALSE;
+
+    int moved = dsk_defrag(drv);
+
+    if (g_batch && drv)
+        dsk_begin(drv);
+
+    if (moved < 0)
+        return FALSE;
+
+    printf("%d granules moved.\n", moved);
+
+    return TRUE;
+}
+
+//---------------------------------
+// show file and free space layout, -m for tab separated records:
+// file name granules extents seeks
+// disk files used extents fragmented seeks free runs largest
+//---------------------------------
+int layout_fn(DSK_Drive *drv, void *params)
+{
+    DSK_FileLayout file;
+    DSK_Layout disk;
+
+    char *popt = strtok(NULL, " \n");
+    int machine = popt && !strcmp(popt, "-m");
+
+    if (dsk_layout(drv, &disk))
+        return FALSE;
+
+    if (!machine)
+        printf("\nFILE\t\tGRANS\tEXTENTS\tSEEKS\n");
+
+    for (int i = 0; i < DSK_MAX_DIR_ENTRIES; i++)
+    {
+        const char *name = drv->dir_names[i];
+
+        if (!name[0] || dsk_file_layout(drv, name, &file))
+            continue;
+
+        if (machine)
+            printf("file\t%s\t%d\t%d\t%d\n", name, file.granules, file.extents, file.seek_tracks);
+        else
+            printf("%-12s\t%d\t%d\t%d\n", name, file.granules, file.extents, file.seek_tracks);
+    }
+
+    if (machine)
+    {
+        printf("disk\t%d\t%d\t%d\t%d\t%ld\t%d\t%d\t%d\n", disk.files, disk.used_granules, disk.extents,
+            disk.fragmented_files, disk.seek_tracks, disk.free_granules, disk.free_runs, disk.largest_free_run);
+        return TRUE;
+    }
+
+    // free space fragmentation, 0% when all free space is one run
+    int frag = disk.free_granules ? 100 - 100 * disk.largest_free_run / disk.free_granules : 0;
+
+    printf("\n%d files, %d granules in %d extents (%d fragmented), %ld track seeks.\n",
+        disk.files, disk.used_granules, disk.extents, disk.fragmented_files, disk.seek_tracks);
+    printf("%d granules free in %d runs, largest %d (%d%% fragmented).\n",
+        disk.free_granules, disk.free_runs, disk.largest_free_run, frag);
 
     return TRUE;
 }
@@ -231,7 +453,13 @@ int del_fn(DSK_Drive *drv, void *params)
         return FALSE;
     }
 
-    dsk_del(drv, filename);
+    if (dsk_del(drv, filename))
+        return FALSE;
+
+    // the batch transaction keeps deleted granules until it ends, flush
+    // so a following add can use them
+    if (g_batch)
+        return flush_drive();
 
     return TRUE;
 }
@@ -249,47 +477,450 @@ int rename_fn(DSK_Drive *drv, void *params)
         return FALSE;
     }
 
-    dsk_rename(drv, file1, file2);
+    return dsk_rename(drv, file1, file2) == E_OK;
+}
+
+//---------------------------------
+// show or resize the track cache
+//---------------------------------
+int cache_fn(DSK_Drive *drv, void *params)
+{
+    DSK_CacheStats stats;
+
+    if (!drv)
+    {
+        puts("no disk mounted.");
+        return FALSE;
+    }
+
+    char *ptracks = strtok(NULL, " \n");
+    if (ptracks && dsk_set_cache_size(drv, atoi(ptracks)))
+        return FALSE;
+
+    dsk_cache_stats(drv, &stats);
+    printf("%d tracks cached, %lu hits, %lu misses, %lu writebacks.\n", drv->cache_size, stats.hits, stats.misses, stats.writebacks);
+
+    return TRUE;
+}
+
+//---------------------------------
+// select the granule allocation policy
+//---------------------------------
+int alloc_fn(DSK_Drive *drv, void *params)
+{
+    char *ppolicy = strtok(NULL, " \n");
+    if (!ppolicy)
+    {
+        puts("missing policy.");
+        return FALSE;
+    }
+
+    DSK_ALLOC_POLICY policy = DSK_ALLOC_FIRST_FIT;
+    if (toupper(ppolicy[0]) == 'B')
+        policy = DSK_ALLOC_BEST_FIT;
+    else if (toupper(ppolicy[0]) == 'N')
+        policy = DSK_ALLOC_NEXT_FIT;
+
+    return dsk_set_alloc_policy(drv, policy) == E_OK;
+}
+
+//---------------------------------
+// start a transaction
+//---------------------------------
+int begin_fn(DSK_Drive *drv, void *params)
+{
+    // batch mode is always in a transaction, begin starts afresh
+    if (g_batch)
+        return flush_drive();
+
+    return dsk_begin(drv) == E_OK;
+}
+
+//---------------------------------
+// write out changes since begin
+//---------------------------------
+int commit_fn(DSK_Drive *drv, void *params)
+{
+    if (g_batch)
+        return flush_drive();
+
+    return dsk_commit(drv) == E_OK;
+}
+
+//---------------------------------
+// discard changes since begin
+//---------------------------------
+int rollback_fn(DSK_Drive *drv, void *params)
+{
+    if (dsk_rollback(drv))
+        return FALSE;
+
+    if (g_batch)
+        return dsk_begin(drv) == E_OK;
 
     return TRUE;
 }
 
+//---------------------------------
+// write out FAT and directory changes
+//---------------------------------
+int flush_fn(DSK_Drive *drv, void *params)
+{
+    return flush_drive();
+}
+
 //---------------------------------
 // command table
 //---------------------------------
 Command cmds[] =
 {
     {"add", add_fn, "add filename \t\t(adds file to mounted DSK)", CMD_SHOW },
+    {"alloc", alloc_fn, "alloc first|best|next \t(set granule allocation policy)", CMD_SHOW },
+    {"begin", begin_fn, "begin \t\t(start a transaction on mounted DSK)", CMD_SHOW },
+    {"cache", cache_fn, "cache [trks]\t\t(show or resize track cache)", CMD_SHOW },
+    {"commit", commit_fn, "commit \t\t(write changes since begin)", CMD_SHOW },
+    {"defrag", defrag_fn, "defrag \t\t(make files on mounted DSK contiguous)", CMD_SHOW },
     {"del", del_fn, "del filename \t(delete file from mounted DSK)", CMD_HIDDEN },
     {"dir", dir_fn, "dir \t\t\t(list directory of mounted DSK)", CMD_SHOW },
     {"dskini", format_fn, "dskini \t(format mounted DSK)", CMD_HIDDEN },
-    {"extract", extract_fn, "extract filename \t(extracts file from mounted DSK)", CMD_SHOW },
+    {"extract", extract_fn, "extract filename \t(extracts file(s) from mounted DSK, * and ? allowed)", CMD_SHOW },
     {"format", format_fn, "format \t\t(format currently mounted DSK)", CMD_SHOW },
+    {"flush", flush_fn, "flush \t\t\t(write pending changes to mounted DSK)", CMD_SHOW },
     {"free", free_fn, "free \t\t\t(report free space on mounted DSK", CMD_SHOW },
     {"grans", gran_map_fn, "grans \t\t(show granule map)", CMD_SHOW },
     {"help", help_fn, "help \t\t\t(list commands and usage)", CMD_SHOW },
     {"kill", del_fn, "kill filename \t(delete file from mounted DSK)", CMD_SHOW},
+    {"layout", layout_fn, "layout [-m]\t\t(show fragmentation of mounted DSK)", CMD_SHOW },
     {"ls", dir_fn, "ls \t(list directory of mounted DSK)", CMD_HIDDEN },
     {"mount", mount_fn, "mount filename \t(mount a DSK file)", CMD_SHOW },
     {"new", new_fn, "new file [trks]\t(create new DSK)", CMD_SHOW },
     {"open", mount_fn, "mount filename \t(mount a DSK file)", CMD_HIDDEN },
+    {"ram", ram_fn, "ram [trks]\t\t(create new DSK in memory)", CMD_SHOW },
     {"q", quit_fn , "q \t\t\t(quit dsktools)", CMD_HIDDEN },
     {"quit", quit_fn , "quit \t\t\t(quit dsktools)", CMD_SHOW },
     {"rename", rename_fn, "rename file1 file2 \t(rename file1 to file2 on mounted DSK)", CMD_SHOW},
     {"ren", rename_fn, "rename file1 file2 \t(rename file1 to file2 on mounted DSK)", CMD_HIDDEN},
+    {"rollback", rollback_fn, "rollback \t\t(discard changes since begin)", CMD_SHOW },
     {"rm", del_fn, "rm \t(delete file from mounted DSK)", CMD_HIDDEN},
+    {"save", save_fn, "save [file]\t\t(write mounted DSK to a file)", CMD_SHOW },
     {"unload", unmount_fn, "unload \t\t(unmount current DSK file)", CMD_HIDDEN },
     {"unmount", unmount_fn, "unmount \t\t(unmount current DSK file)", CMD_SHOW },
 
     { NULL, NULL , NULL}
 };
 
+#ifdef DSK_HAVE_DAEMON
+//---------------------------------
+// dsktoolsd client, commands are sent to the daemon for the DSK
+// named by mount and the replies printed
+//---------------------------------
+int g_sock = -1;
+char g_remote_dsk[FILENAME_MAX];
+Command remote_cmds[];
+
+//---------------------------------
+// connect to dsktoolsd
+//---------------------------------
+int remote_connect(const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return FALSE;
+
+    strcpy(addr.sun_path, path);
+
+    g_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (g_sock < 0 || connect(g_sock, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "cannot connect to dsktoolsd at %s.\n", path);
+        return FALSE;
+    }
+
+    g_cmds = remote_cmds;
+
+    return TRUE;
+}
+
+//---------------------------------
+// send a request about the mounted DSK, print its output and return
+// any file data, which the caller frees
+//---------------------------------
+int remote_request(DSKD_OP op, const char **args, int count, const void *data, uint32_t size, char **reply, uint32_t *reply_size)
+{
+    char buf[DSKD_MAX_ARGS];
+    size_t used = 0;
+    DSKD_Header h;
+
+    if (!g_remote_dsk[0])
+    {
+        puts("no disk mounted.");
+        return FALSE;
+    }
+
+    // the DSK path then the args, each NUL terminated
+    for (int i = -1; i < count; i++)
+    {
+        const char *arg = i < 0 ? g_remote_dsk : args[i];
+        size_t len = strlen(arg) + 1;
+
+        if (used + len > sizeof(buf))
+            return FALSE;
+
+        memcpy(buf + used, arg, len);
+        used += len;
+    }
+
+    if (dskd_send(g_sock, op, buf, used, data, size) || dskd_read_header(g_sock, &h))
+    {
+        fputs("lost connection to dsktoolsd.\n", stderr);
+        return FALSE;
+    }
+
+    char *text = malloc(h.args_size + 1);
+    char *body = malloc(h.data_size ? h.data_size : 1);
+
+    if (!text || !body || dskd_read(g_sock, text, h.args_size) || dskd_read(g_sock, body, h.data_size))
+    {
+        free(text);
+        free(body);
+        fputs("lost connection to dsktoolsd.\n", stderr);
+        return FALSE;
+    }
+
+    text[h.args_size] = 0;
+    fputs(text, stdout);
+    free(text);
+
+    if (reply)
+    {
+        *reply = body;
+        *reply_size = h.data_size;
+    }
+    else
+        free(body);
+
+    return (int32_t)h.op == E_OK;
+}
+
+//---------------------------------
+// name the DSK for following commands
+//---------------------------------
+int remote_mount(const char *filename)
+{
+    // the daemon runs elsewhere, send it a full path
+    if (!realpath(filename, g_remote_dsk))
+    {
+        g_remote_dsk[0] = 0;
+        printf("Disk (%s) not found.\n", filename);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+int remote_mount_fn(DSK_Drive *drv, void *params)
+{
+    char *filename = strtok(NULL, " \n");
+    if (!filename)
+    {
+        puts("missing filename.");
+        return FALSE;
+    }
+
+    return remote_mount(filename);
+}
+
+//
+int remote_unmount_fn(DSK_Drive *drv, void *params)
+{
+    g_remote_dsk[0] = 0;
+    return TRUE;
+}
+
+//
+int remote_dir_fn(DSK_Drive *drv, void *params)
+{
+    return remote_request(DSKD_DIR, NULL, 0, NULL, 0, NULL, NULL);
+}
+
+//
+int remote_free_fn(DSK_Drive *drv, void *params)
+{
+    return remote_request(DSKD_FREE, NULL, 0, NULL, 0, NULL, NULL);
+}
+
+//
+int remote_grans_fn(DSK_Drive *drv, void *params)
+{
+    return remote_request(DSKD_GRANS, NULL, 0, NULL, 0, NULL, NULL);
+}
+
+//
+int remote_flush_fn(DSK_Drive *drv, void *params)
+{
+    return remote_request(DSKD_FLUSH, NULL, 0, NULL, 0, NULL, NULL);
+}
+
+//---------------------------------
+// send a local file to be added to the DSK
+//---------------------------------
+int remote_add_fn(DSK_Drive *drv, void *params)
+{
+    char *filename = strtok(NULL, " \n");
+    if (!filename)
+    {
+        puts("missing filename.");
+        return FALSE;
+    }
+
+    DSK_OPEN_MODE mode;
+    DSK_FILE_TYPE type;
+    parse_mode_type(&mode, &type);
+
+    FILE *fin = fopen(filename, "rb");
+    if (!fin)
+    {
+        printf("file '%s' not found.\n", filename);
+        return FALSE;
+    }
+
+    fseek(fin, 0, SEEK_END);
+    long size = ftell(fin);
+    fseek(fin, 0, SEEK_SET);
+
+    char *data = size >= 0 && size <= DSKD_MAX_DATA ? malloc(size ? size : 1) : NULL;
+    if (!data || (size && fread(data, size, 1, fin) != 1))
+    {
+        printf("error reading file '%s'.\n", filename);
+        free(data);
+        fclose(fin);
+        return FALSE;
+    }
+
+    fclose(fin);
+
+    // the DSK only holds the base name
+    const char *name = strrchr(filename, '/');
+    name = name ? name + 1 : filename;
+
+    char type_buf[8];
+    snprintf(type_buf, sizeof(type_buf), "%d", type);
+
+    const char *args[] = { name, mode == DSK_MODE_ASCII ? "A" : "B", type_buf };
+    int result = remote_request(DSKD_ADD, args, 3, data, size, NULL, NULL);
+
+    free(data);
+
+    return result;
+}
+
+//---------------------------------
+// extract a file from the DSK to a local file
+//---------------------------------
+int remote_extract_fn(DSK_Drive *drv, void *params)
+{
+    char *filename = strtok(NULL, " \n");
+    if (!filename)
+    {
+        puts("missing filename.");
+        return FALSE;
+    }
+
+    char *data = NULL;
+    uint32_t size;
+    const char *args[] = { filename };
+
+    if (!remote_request(DSKD_EXTRACT, args, 1, NULL, 0, &data, &size))
+    {
+        free(data);
+        return FALSE;
+    }
+
+    // always open in binary mode for consistent behavior
+    FILE *fout = fopen(filename, "wb");
+    int result = fout && (!size || fwrite(data, size, 1, fout) == 1);
+
+    if (fout && fclose(fout))
+        result = FALSE;
+
+    if (!result)
+        puts("cannot create file.");
+
+    free(data);
+
+    return result;
+}
+
+//
+int remote_del_fn(DSK_Drive *drv, void *params)
+{
+    char *filename = strtok(NULL, " \n");
+    if (!filename)
+    {
+        puts("missing filename.");
+        return FALSE;
+    }
+
+    const char *args[] = { filename };
+
+    return remote_request(DSKD_DEL, args, 1, NULL, 0, NULL, NULL);
+}
+
+//
+int remote_rename_fn(DSK_Drive *drv, void *params)
+{
+    char *file1 = strtok(NULL, " \n");
+    char *file2 = strtok(NULL, " \n");
+    if (!file1 || !file2)
+    {
+        puts("missing filename.");
+        return FALSE;
+    }
+
+    const char *args[] = { file1, file2 };
+
+    return remote_request(DSKD_RENAME, args, 2, NULL, 0, NULL, NULL);
+}
+
+//---------------------------------
+// commands available through dsktoolsd
+//---------------------------------
+Command remote_cmds[] =
+{
+    {"add", remote_add_fn, "add filename \t\t(adds file to mounted DSK)", CMD_SHOW },
+    {"del", remote_del_fn, "del filename \t(delete file from mounted DSK)", CMD_HIDDEN },
+    {"dir", remote_dir_fn, "dir \t\t\t(list directory of mounted DSK)", CMD_SHOW },
+    {"extract", remote_extract_fn, "extract filename \t(extracts file from mounted DSK)", CMD_SHOW },
+    {"flush", remote_flush_fn, "flush \t\t\t(write pending changes to mounted DSK)", CMD_SHOW },
+    {"free", remote_free_fn, "free \t\t\t(report free space on mounted DSK", CMD_SHOW },
+    {"grans", remote_grans_fn, "grans \t\t(show granule map)", CMD_SHOW },
+    {"help", help_fn, "help \t\t\t(list commands and usage)", CMD_SHOW },
+    {"kill", remote_del_fn, "kill filename \t(delete file from mounted DSK)", CMD_SHOW},
+    {"ls", remote_dir_fn, "ls \t(list directory of mounted DSK)", CMD_HIDDEN },
+    {"mount", remote_mount_fn, "mount filename \t(mount a DSK file)", CMD_SHOW },
+    {"open", remote_mount_fn, "mount filename \t(mount a DSK file)", CMD_HIDDEN },
+    {"q", quit_fn , "q \t\t\t(quit dsktools)", CMD_HIDDEN },
+    {"quit", quit_fn , "quit \t\t\t(quit dsktools)", CMD_SHOW },
+    {"rename", remote_rename_fn, "rename file1 file2 \t(rename file1 to file2 on mounted DSK)", CMD_SHOW},
+    {"ren", remote_rename_fn, "rename file1 file2 \t(rename file1 to file2 on mounted DSK)", CMD_HIDDEN},
+    {"rm", remote_del_fn, "rm \t(delete file from mounted DSK)", CMD_HIDDEN},
+    {"unload", remote_unmount_fn, "unload \t\t(unmount current DSK file)", CMD_HIDDEN },
+    {"unmount", remote_unmount_fn, "unmount \t\t(unmount current DSK file)", CMD_SHOW },
+
+    { NULL, NULL , NULL}
+};
+#endif
+
 //-------------------
 // execute dbg cmd
 //-------------------
 int exec_cmd(DSK_Drive *drv, char *cmd)
 {
-    Command *pCmd = cmds;
+    Command *pCmd = g_cmds;
 
     if (!cmd)
         return TRUE;
@@ -320,17 +951,155 @@ void banner()
     puts(" \\__,_|___/_|\\_\\\\__\\___/ \\___/|_|___/\n");
 }
 
+//-------------------
+// run a line of ; separated commands, stopping at the first failure
+//-------------------
+int run_line(char *line)
+{
+    char *next;
+
+    // scripts may have been written on Windows
+    line[strcspn(line, "\r\n")] = 0;
+
+    for (; line && !done; line = next)
+    {
+        next = strchr(line, ';');
+        if (next)
+            *next++ = 0;
+
+        // skip empty commands and # comments
+        char *pCmd = strtok(line, " \n");
+        if (!pCmd || pCmd[0] == '#')
+            continue;
+
+        if (!exec_cmd(g_drv, pCmd))
+        {
+            fprintf(stderr, "Command '%s' failed.\n", pCmd);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//-------------------
+// run commands, then each line of fin, without prompts
+//-------------------
+int run_batch(char *commands, FILE *fin)
+{
+    char buf[LINE_BUFFER];
+    int ok = TRUE;
+
+    if (commands)
+        ok = run_line(commands);
+
+    while (ok && !done && fin && fgets(buf, sizeof(buf), fin))
+    {
+        if (!strchr(buf, '\n') && !feof(fin))
+        {
+            fputs("line too long.\n", stderr);
+            ok = FALSE;
+            break;
+        }
+
+        ok = run_line(buf);
+    }
+
+    // on failure the DSK is left as it was at the last flush
+    if (!ok && g_drv && g_drv->in_transaction)
+        dsk_rollback(g_drv);
+
+    release_drive();
+
+    return ok;
+}
+
 //-------------------
 // main program start
+//
+// dsktools [-c "cmd; cmd"] [-f script] [-s socket] [dskfile]
+//
+// With -c, -f or commands piped in, dsktools runs them without the
+// banner or prompts, writes the FAT and directory once at the end and
+// exits with an error at the first failed command. With -s commands
+// are sent to a dsktoolsd listening on socket.
 //-------------------
 int main(int argc, char *argv[])
 {
     char buf[SMALL_BUFFER];
+    char *commands = NULL, *script = NULL, *socket_path = NULL;
+    int arg = 1;
 
     assert(sizeof(DSK_DirEntry) == 32);
 
-    if (argc > 1)
-        g_drv = dsk_mount_drive(argv[1]);
+    for (; arg < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if (arg + 1 < argc && !strcmp(argv[arg], "-c"))
+            commands = argv[arg + 1];
+        else if (arg + 1 < argc && !strcmp(argv[arg], "-f"))
+            script = argv[arg + 1];
+#ifdef DSK_HAVE_DAEMON
+        else if (arg + 1 < argc && !strcmp(argv[arg], "-s"))
+            socket_path = argv[arg + 1];
+#endif
+        else
+        {
+            puts("usage: dsktools [-c \"cmd; cmd\"] [-f script] [-s socket] [dskfile]");
+            exit(E_FAIL);
+        }
+    }
+
+#ifdef DSK_HAVE_DAEMON
+    if (socket_path && !remote_connect(socket_path))
+        exit(E_FAIL);
+#endif
+
+    g_batch = commands || script || !isatty(fileno(stdin));
+
+    FILE *fin = NULL;
+    if (script)
+    {
+        fin = strcmp(script, "-") ? fopen(script, "r") : stdin;
+        if (!fin)
+        {
+            fprintf(stderr, "cannot open script '%s'.\n", script);
+            exit(E_FAIL);
+        }
+    }
+    else if (g_batch && !commands)
+        fin = stdin;
+
+    // recently used images stay mounted
+    g_pool = dsk_pool_new(DSK_DEFAULT_POOL_SIZE, DSK_MOUNT_MMAP);
+    if (!g_pool)
+        return E_FAIL;
+
+    if (arg < argc)
+    {
+        int mounted;
+
+#ifdef DSK_HAVE_DAEMON
+        if (socket_path)
+            mounted = remote_mount(argv[arg]);
+        else
+#endif
+            mounted = mount_drive(argv[arg]) != NULL;
+
+        if (!mounted && g_batch)
+            return E_FAIL;
+    }
+
+    if (g_batch)
+    {
+        int ok = run_batch(commands, fin);
+
+        if (fin && fin != stdin)
+            fclose(fin);
+
+        dsk_pool_free(g_pool);
+
+        return ok ? E_OK : E_FAIL;
+    }
 
     banner();
 
@@ -340,7 +1109,8 @@ int main(int argc, char *argv[])
     while (!done)
     {
         printf("\ndsktools>");
-        fgets(buf, SMALL_BUFFER - 1, stdin);
+        if (!fgets(buf, SMALL_BUFFER - 1, stdin))
+            break;
 
         char* pCmd = strtok(buf, " \n");
         if (!exec_cmd(g_drv, pCmd))
@@ -349,5 +1119,8 @@ int main(int argc, char *argv[])
             puts("OK");
     }
 
+    release_drive();
+    dsk_pool_free(g_pool);
+
     return 0;
 }